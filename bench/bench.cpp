@@ -0,0 +1,261 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <numbers>
+#include <stdexcept>
+#include "geometry.h"
+#include "optics.h"
+#include "packet.h"
+#include "layout.h"
+#include "scenes.h"
+
+// Throughput benchmarks of the tracer: micro-benchmarks of the intersection and emergence kernels, and whole simulations of
+// the synthetic scenes of scenes.h. Every benchmark is run a few times untimed, then timed over several repetitions
+
+static const char *kUsage =
+    "usage: optsim-bench [options]\n"
+    "  --filter <text>     run only the benchmarks whose name contains text\n"
+    "  --warmup <n>        untimed runs before the timed ones (default 1)\n"
+    "  --reps <n>          timed runs (default 5)\n"
+    "  --threads <n>       tracing threads, 0 for every hardware thread (default 1)\n"
+    "  --scale <f>         multiply the number of light rays of every scene by f (default 1)\n";
+
+struct BenchOptions
+{
+    std::string filter;
+    size_t warmup = 1;
+    size_t repetitions = 5;
+    size_t thread_count = 1;
+    double scale = 1.0;
+};
+
+// Statistics of the timed runs of a benchmark, in seconds
+struct Statistics
+{
+    double median;
+    double min;
+    double mean;
+    double stddev;
+};
+
+// Keep the compiler from optimizing away the computation of value
+template <class T>
+inline void DoNotOptimize(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static Statistics Summarize(std::vector<double> seconds)
+{
+    std::sort(seconds.begin(), seconds.end());
+    size_t n = seconds.size();
+    Statistics stats;
+    stats.median = n % 2 == 1 ? seconds[n / 2] : 0.5 * (seconds[n / 2 - 1] + seconds[n / 2]);
+    stats.min = seconds.front();
+    stats.mean = 0.0;
+    for (double s : seconds)
+        stats.mean += s;
+    stats.mean /= static_cast<double>(n);
+    double variance = 0.0;
+    for (double s : seconds)
+        variance += (s - stats.mean) * (s - stats.mean);
+    stats.stddev = n > 1 ? std::sqrt(variance / static_cast<double>(n - 1)) : 0.0;
+    return stats;
+}
+
+static Statistics Measure(const BenchOptions &options, const std::function<void()> &run)
+{
+    for (size_t k = 0; k < options.warmup; k++)
+        run();
+    std::vector<double> seconds;
+    for (size_t k = 0; k < options.repetitions; k++)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        run();
+        seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+    return Summarize(seconds);
+}
+
+// Print a row of results; rates holds the number of items processed by a run and the unit of their throughput
+static void Report(const std::string &name, const Statistics &stats, std::initializer_list<std::pair<double, const char *>> rates)
+{
+    std::printf("%-48s %10.3f %10.3f %7.1f%%", name.c_str(), stats.median * 1e3, stats.min * 1e3, 100.0 * stats.stddev / stats.mean);
+    for (const auto &[count, unit] : rates)
+        std::printf("  %10.3e %s", count / stats.median, unit);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+static bool Selected(const BenchOptions &options, const std::string &name)
+{
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// Random rays and segments in the 20 x 20 square, for the micro-benchmarks
+static void RandomRaysAndSegments(size_t n, std::vector<Ray> &rays, std::vector<Segment> &segments)
+{
+    SceneRandom random(7);
+    for (size_t i = 0; i < n; i++)
+    {
+        double angle = random.Uniform(0.0, 2.0 * std::numbers::pi);
+        rays.push_back(Ray(Point{random.Uniform(-10.0, 10.0), random.Uniform(-10.0, 10.0)}, Vec{std::cos(angle), std::sin(angle)}));
+        angle = random.Uniform(0.0, 2.0 * std::numbers::pi);
+        segments.push_back(Segment(Point{random.Uniform(-10.0, 10.0), random.Uniform(-10.0, 10.0)}, Vec{std::cos(angle), std::sin(angle)}.Scale(2.0)));
+    }
+}
+
+static void RunMicroBenchmarks(const BenchOptions &options)
+{
+    constexpr size_t kCount = 1024;
+    constexpr size_t kTests = kCount * kCount;
+    std::vector<Ray> rays;
+    std::vector<Segment> segments;
+    RandomRaysAndSegments(kCount, rays, segments);
+
+    if (Selected(options, "micro/GetLineIntersection"))
+        Report("micro/GetLineIntersection", Measure(options, [&]
+                                                    {
+                                                        for (const Ray &ray : rays)
+                                                            for (const Segment &seg : segments)
+                                                            {
+                                                                Intersection x = GetLineIntersection(ray, seg);
+                                                                DoNotOptimize(x);
+                                                            } }),
+               {{static_cast<double>(kTests), "tests/s"}});
+
+    if (Selected(options, "micro/IntersectPacket"))
+    {
+        std::vector<RayPacket> packets(kCount / kPacketWidth);
+        for (size_t i = 0; i < kCount; i++)
+            packets[i / kPacketWidth].Set(i % kPacketWidth, rays[i], -1);
+        Report("micro/IntersectPacket", Measure(options, [&]
+                                                {
+                                                    PacketHits hits;
+                                                    for (const RayPacket &packet : packets)
+                                                    {
+                                                        hits.Reset();
+                                                        for (size_t i = 0; i < kCount; i++)
+                                                            IntersectPacket(packet, segments[i], static_cast<int64_t>(i), hits);
+                                                        DoNotOptimize(hits);
+                                                    } }),
+               {{static_cast<double>(kTests), "tests/s"}});
+    }
+
+    // Emergence from every hit of the rays on the segments, as the tracer computes it after finding the nearest hit
+    std::vector<IncidenceState> incidences;
+    std::vector<size_t> hit_segments;
+    for (const Ray &ray : rays)
+        for (size_t i = 0; i < kCount && incidences.size() < kCount * 16; i++)
+        {
+            Intersection x = GetLineIntersection(ray, segments[i]);
+            if (x.num_intersects == Intersection::OneIntersection)
+            {
+                incidences.push_back({x, false, ray.GetDirection()});
+                hit_segments.push_back(i);
+            }
+        }
+    auto emergence = [&](const char *name, auto compile)
+    {
+        if (!Selected(options, name))
+            return;
+        std::vector<decltype(compile(segments[0]))> compiled;
+        for (const Segment &seg : segments)
+            compiled.push_back(compile(seg));
+        Report(name, Measure(options, [&]
+                             {
+                                 for (size_t k = 0; k < incidences.size(); k++)
+                                 {
+                                     Ray ray = ComputeEmergence(compiled[hit_segments[k]], incidences[k]);
+                                     DoNotOptimize(ray);
+                                 } }),
+               {{static_cast<double>(incidences.size()), "rays/s"}});
+    };
+    emergence("micro/Emergence/Mirror", [](const Segment &seg) { return CompiledMirror(Mirror{seg}); });
+    emergence("micro/Emergence/Lens", [](const Segment &seg) { return CompiledLens(Lens{seg, 2.0}); });
+    emergence("micro/Emergence/Refractive", [](const Segment &seg) { return CompiledRefractiveSurface(RefractiveSurface{seg, 1.0, 1.5}); });
+}
+
+// Simulate a scene built by build with each tracing configuration
+static void RunSceneBenchmark(const BenchOptions &options, const std::string &name, const std::function<void(LayoutBuilder &)> &build, bool linear)
+{
+    struct Configuration
+    {
+        const char *name;
+        IntersectionMode mode;
+        bool packets;
+    };
+    const Configuration configurations[] = {
+        {"linear", IntersectionMode::LinearScan, false},
+        {"bvh", IntersectionMode::BoundingVolumeHierarchy, false},
+        {"bvh-packets", IntersectionMode::BoundingVolumeHierarchy, true},
+    };
+    for (const Configuration &configuration : configurations)
+    {
+        std::string full_name = name + "/" + configuration.name;
+        if ((configuration.mode == IntersectionMode::LinearScan && !linear) || !Selected(options, full_name))
+            continue;
+        Field field;
+        FieldBuilder builder(field);
+        build(builder);
+        field.SetIntersectionMode(configuration.mode);
+        field.SetPacketTracing(configuration.packets);
+        field.SetThreadCount(options.thread_count);
+        Statistics stats = Measure(options, [&] { field.Simulation(); });
+        // Count the work of a run in an extra untimed run, so that the counters do not weigh on the timings
+        field.SetCollectStats(true);
+        field.Simulation();
+        const SimulationStats &counters = field.GetStats();
+        Report(full_name, stats, {{static_cast<double>(counters.rays), "rays/s"}, {static_cast<double>(counters.bounces), "bounces/s"}, {static_cast<double>(counters.intersection_tests), "tests/s"}});
+    }
+}
+
+static void RunSceneBenchmarks(const BenchOptions &options)
+{
+    auto rays = [&](size_t n) { return std::max<size_t>(1, static_cast<size_t>(static_cast<double>(n) * options.scale)); };
+    RunSceneBenchmark(options, "scene/random-1k-rays-100-segments", [&](LayoutBuilder &b) { BuildRandomScene(b, rays(1000), 100, 20.0, 1); }, true);
+    RunSceneBenchmark(options, "scene/random-2k-rays-10k-segments", [&](LayoutBuilder &b) { BuildRandomScene(b, rays(2000), 10000, 200.0, 2); }, false);
+    RunSceneBenchmark(options, "scene/cavity-200-rays-64-facets", [&](LayoutBuilder &b) { BuildMirrorCavity(b, rays(200), 64, 3); }, true);
+    RunSceneBenchmark(options, "scene/lens-2k-rays-600-segments", [&](LayoutBuilder &b) { BuildTessellatedLens(b, rays(2000), 600); }, true);
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                throw std::invalid_argument(arg);
+            if (arg == "--filter")
+                options.filter = argv[++i];
+            else if (arg == "--warmup")
+                options.warmup = std::stoul(argv[++i]);
+            else if (arg == "--reps")
+                options.repetitions = std::max<size_t>(1, std::stoul(argv[++i]));
+            else if (arg == "--threads")
+                options.thread_count = std::stoul(argv[++i]);
+            else if (arg == "--scale")
+                options.scale = std::stod(argv[++i]);
+            else
+                throw std::invalid_argument(arg);
+        }
+    }
+    catch (const std::logic_error &)
+    {
+        std::fprintf(stderr, "%s", kUsage);
+        return 2;
+    }
+
+    std::printf("packet width %zu, %zu thread(s), %zu warm-up and %zu timed run(s)\n", kPacketWidth, options.thread_count, options.warmup, options.repetitions);
+    std::printf("%-48s %10s %10s %8s  %s\n", "benchmark", "median ms", "min ms", "stddev", "throughput at the median");
+    RunMicroBenchmarks(options);
+    RunSceneBenchmarks(options);
+    return 0;
+}
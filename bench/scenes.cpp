@@ -0,0 +1,68 @@
+#include "scenes.h"
+#include <cmath>
+#include <numbers>
+
+void BuildRandomScene(LayoutBuilder &builder, size_t rays, size_t segments, double size, uint64_t seed)
+{
+    SceneRandom random(seed);
+    double half = 0.5 * size;
+    for (size_t i = 0; i < segments; i++)
+    {
+        Point start{random.Uniform(-half, half), random.Uniform(-half, half)};
+        double angle = random.Uniform(0.0, 2.0 * std::numbers::pi);
+        double length = random.Uniform(0.2, 2.0);
+        Segment seg(start, Vec{std::cos(angle), std::sin(angle)}.Scale(length));
+        uint64_t type = random.Next() % 4;
+        if (type < 2)
+            builder.AddMirror(Mirror{seg});
+        else if (type == 2)
+            builder.AddLens(Lens{seg, (random.Next() % 2 == 0 ? 1.0 : -1.0) * random.Uniform(1.0, 5.0)});
+        else
+            builder.AddRefractive(RefractiveSurface{seg, 1.0, random.Uniform(1.2, 1.8)});
+    }
+    for (size_t i = 0; i < rays; i++)
+    {
+        Point start{random.Uniform(-half, half), random.Uniform(-half, half)};
+        double angle = random.Uniform(0.0, 2.0 * std::numbers::pi);
+        builder.AddLightRay(Ray(start, Vec{std::cos(angle), std::sin(angle)}));
+    }
+}
+
+void BuildMirrorCavity(LayoutBuilder &builder, size_t rays, size_t facets, uint64_t seed)
+{
+    SceneRandom random(seed);
+    auto corner = [&](size_t k)
+    {
+        double angle = 2.0 * std::numbers::pi * static_cast<double>(k) / static_cast<double>(facets);
+        return Point{10.0 * std::cos(angle), 10.0 * std::sin(angle)};
+    };
+    for (size_t k = 0; k < facets; k++)
+    {
+        Point start = corner(k);
+        builder.AddMirror(Mirror{Segment(start, corner(k + 1) - start)});
+    }
+    for (size_t i = 0; i < rays; i++)
+    {
+        Point start{random.Uniform(-1.0, 1.0), random.Uniform(-1.0, 1.0)};
+        double angle = random.Uniform(0.0, 2.0 * std::numbers::pi);
+        builder.AddLightRay(Ray(start, Vec{std::cos(angle), std::sin(angle)}));
+    }
+}
+
+void BuildTessellatedLens(LayoutBuilder &builder, size_t rays, size_t segments)
+{
+    // Face x = -sqrt((3 + y^2) / 3) for y in [-3, 3]
+    auto face = [](double y) { return Point{-std::sqrt((3.0 + y * y) / 3.0), y}; };
+    for (size_t k = 0; k < segments; k++)
+    {
+        Point start = face(-3.0 + 6.0 * static_cast<double>(k) / static_cast<double>(segments));
+        Point end = face(-3.0 + 6.0 * static_cast<double>(k + 1) / static_cast<double>(segments));
+        builder.AddRefractive(RefractiveSurface{Segment(start, end - start), 1.5, 1.0});
+    }
+    builder.AddRefractive(RefractiveSurface{Segment(Point{-2.0, 3.0}, Vec{0.0, -6.0}), 1.5, 1.0});
+    for (size_t i = 0; i < rays; i++)
+    {
+        double y = rays > 1 ? -1.0 + 2.0 * static_cast<double>(i) / static_cast<double>(rays - 1) : 0.0;
+        builder.AddLightRay(Ray(Point{-4.0, y}, Vec{1.0, 0.0}));
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "layout.h"
+#include <cstdint>
+#include <cstddef>
+
+// Deterministic pseudo-random numbers (splitmix64), identical on every platform and standard library so that the generated
+// scenes, and the throughput measured on them, are reproducible
+class SceneRandom
+{
+private:
+    uint64_t state_;
+
+public:
+    explicit SceneRandom(uint64_t seed) : state_(seed) {}
+    uint64_t Next()
+    {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+    // Uniform in [lo, hi)
+    double Uniform(double lo, double hi) { return lo + (hi - lo) * static_cast<double>(Next() >> 11) * 0x1.0p-53; }
+};
+
+// rays light rays and segments optical elements of random position, orientation and type, in a size x size square centered
+// on the origin; half of the elements are mirrors, a quarter lenses and a quarter refractive surfaces. Scaling size with the
+// square root of segments keeps the density of the elements, and so the mean free path of the light rays
+void BuildRandomScene(LayoutBuilder &builder, size_t rays, size_t segments, double size, uint64_t seed);
+
+// A closed cavity of facets mirrors along a circle of radius 10, with rays light rays starting near its center; the light rays
+// bounce until they run out of steps, the worst case of the tracer
+void BuildMirrorCavity(LayoutBuilder &builder, size_t rays, size_t facets, uint64_t seed);
+
+// The aspheric lens of test/layout/layout-2.lua, its curved face tessellated into segments refractive surfaces, lit by a
+// parallel beam of rays light rays
+void BuildTessellatedLens(LayoutBuilder &builder, size_t rays, size_t segments);
+
+#endif
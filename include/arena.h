@@ -0,0 +1,88 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "geometry.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+
+// Traced path stored in a PathArena as its list of vertices; consecutive vertices are the ends of a segment of the path
+struct PathView
+{
+    const Point *vertices = nullptr;
+    size_t count = 0;
+    size_t Size() const { return count; }
+    const Point &operator[](size_t i) const { return vertices[i]; }
+    const Point *begin() const { return vertices; }
+    const Point *end() const { return vertices + count; }
+};
+
+// Vertex storage shared by all traced paths of a Field; the memory is kept in blocks that never move while paths are written,
+// and is reused by the next simulation instead of being freed
+class PathArena
+{
+public:
+    // Number of vertices in a block; longer paths get a block of their own
+    static constexpr size_t kBlockSize = 4096;
+
+    // Appends the vertices of one path at a time; each thread, or each lane of a RayPacket, uses its own Writer
+    class Writer
+    {
+    public:
+        explicit Writer(PathArena &arena) : arena_(&arena) {}
+        // Start a new path; a Writer must not be used across a reset of its arena
+        void Begin() { start_ = cursor_; }
+        void Push(const Point &p)
+        {
+            if (cursor_ == capacity_)
+                Grow();
+            data_[cursor_++] = p;
+        }
+        // Finish the path, which stays valid until the arena is reset
+        PathView End() { return {data_ + start_, cursor_ - start_}; }
+        // Give the vertices of the path last begun back to the Writer, invalidating its PathView, once it is no longer needed
+        void Discard() { cursor_ = start_; }
+
+    private:
+        PathArena *arena_;
+        Point *data_ = nullptr;
+        size_t start_ = 0;
+        size_t cursor_ = 0;
+        size_t capacity_ = 0;
+
+        // Move the path being written to a new block with room for more vertices
+        void Grow();
+    };
+
+    // Make all blocks available for new paths; every PathView handed out before is invalidated
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ = 0;
+    }
+    // Number of vertices the arena holds without allocating
+    size_t GetCapacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t capacity = 0;
+        for (const auto &block : blocks_)
+            capacity += block.capacity;
+        return capacity;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<Point[]> data;
+        size_t capacity;
+    };
+    mutable std::mutex mutex_;
+    std::vector<Block> blocks_; // blocks_[0, used_) are handed out to Writers
+    size_t used_ = 0;
+
+    // Hand out an unused block holding at least min_capacity vertices, returning its data and setting its capacity
+    Point *Acquire(size_t min_capacity, size_t &capacity);
+};
+
+#endif
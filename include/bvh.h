@@ -0,0 +1,147 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "geometry.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Bounding volume hierarchy over a set of segments, used to find the nearest segment hit by a ray
+class SegmentBVH
+{
+private:
+    // Node of the hierarchy; an inner node has its left child right after itself and its right child at first_,
+    // a leaf node refers to indices_[first_, first_ + count_)
+    struct Node
+    {
+        BoundingBox box;
+        uint32_t first;
+        uint32_t count;
+        bool IsLeaf() const { return count > 0; }
+    };
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> indices_;
+
+    uint32_t BuildNode(const std::vector<BoundingBox> &boxes, const std::vector<Point> &centers, uint32_t begin, uint32_t end);
+
+public:
+    // Maximum number of segments stored in a leaf node
+    static constexpr uint32_t kLeafSize = 4;
+    // Maximum depth of the hierarchy; the median split keeps the depth logarithmic in the number of segments
+    static constexpr int kMaxDepth = 64;
+
+    // Rebuild the hierarchy over the given segments; index i of a hit refers to segments[i]
+    void Build(const std::vector<Segment> &segments);
+    void Clear()
+    {
+        nodes_.clear();
+        indices_.clear();
+    }
+    bool Empty() const { return nodes_.empty(); }
+    // Total bounds of all segments
+    BoundingBox GetBounds() const { return nodes_.empty() ? BoundingBox{} : nodes_[0].box; }
+
+    // Visit the segments that may be hit by the ray, front-to-back; hit(i, t_max) is called for each candidate segment i
+    // and lowers t_max when it finds a nearer hit, which prunes the subtrees behind it
+    template <class HitFunctor>
+    void Traverse(const Ray &ray, double t_max, HitFunctor &&hit) const
+    {
+        if (nodes_.empty())
+            return;
+        double t_enter, t_exit;
+        if (!nodes_[0].box.Clip(ray, t_enter, t_exit) || t_enter > t_max)
+            return;
+        struct Entry
+        {
+            uint32_t node;
+            double t_enter;
+        } stack[kMaxDepth];
+        int top = 0;
+        stack[top++] = {0, t_enter};
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.t_enter > t_max)
+                continue;
+            const Node &node = nodes_[entry.node];
+            if (node.IsLeaf())
+            {
+                for (uint32_t k = node.first; k < node.first + node.count; k++)
+                    hit(static_cast<size_t>(indices_[k]), t_max);
+                continue;
+            }
+            uint32_t left = entry.node + 1, right = node.first;
+            double t_left, t_right, t_exit_left, t_exit_right;
+            bool hit_left = nodes_[left].box.Clip(ray, t_left, t_exit_left) && t_left <= t_max;
+            bool hit_right = nodes_[right].box.Clip(ray, t_right, t_exit_right) && t_right <= t_max;
+            // Push the farther child first so that the nearer one is visited first
+            if (hit_left && hit_right)
+            {
+                if (t_left <= t_right)
+                {
+                    stack[top++] = {right, t_right};
+                    stack[top++] = {left, t_left};
+                }
+                else
+                {
+                    stack[top++] = {left, t_left};
+                    stack[top++] = {right, t_right};
+                }
+            }
+            else if (hit_left)
+                stack[top++] = {left, t_left};
+            else if (hit_right)
+                stack[top++] = {right, t_right};
+        }
+    }
+
+    // Visit the leaves whose boxes pass test(box, t_enter), nearest t_enter first; test reports the parameter at which the box
+    // is entered, and visit(indices, count, t_max) is called with the segment indices of a leaf and may lower t_max
+    template <class BoxTest, class LeafVisitor>
+    void TraverseLeaves(double t_max, BoxTest &&test, LeafVisitor &&visit) const
+    {
+        if (nodes_.empty())
+            return;
+        double t_enter;
+        if (!test(nodes_[0].box, t_enter) || t_enter > t_max)
+            return;
+        struct Entry
+        {
+            uint32_t node;
+            double t_enter;
+        } stack[kMaxDepth];
+        int top = 0;
+        stack[top++] = {0, t_enter};
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.t_enter > t_max)
+                continue;
+            const Node &node = nodes_[entry.node];
+            if (node.IsLeaf())
+            {
+                visit(&indices_[node.first], node.count, t_max);
+                continue;
+            }
+            uint32_t left = entry.node + 1, right = node.first;
+            double t_left, t_right;
+            bool hit_left = test(nodes_[left].box, t_left) && t_left <= t_max;
+            bool hit_right = test(nodes_[right].box, t_right) && t_right <= t_max;
+            if (hit_left && hit_right && t_left > t_right)
+            {
+                stack[top++] = {left, t_left};
+                stack[top++] = {right, t_right};
+            }
+            else
+            {
+                if (hit_right)
+                    stack[top++] = {right, t_right};
+                if (hit_left)
+                    stack[top++] = {left, t_left};
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+#include <string>
+
+// Watches a file for saves with inotify. The directory holding the file is watched rather than the file itself, so that editors
+// that save by writing a new file and renaming it over the old one are followed too. The owner waits for GetFd to become
+// readable, for example with Fl::add_fd, then calls ReadChanges
+class FileWatcher
+{
+private:
+    int fd_ = -1;
+    int watch_ = -1;
+    std::string name_; // Name of the file within the watched directory
+
+public:
+    // A watcher watching nothing yet; GetFd is -1 if inotify is unavailable
+    FileWatcher();
+    ~FileWatcher();
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // Watch path instead of the file watched so far; false if it cannot be watched
+    bool Watch(const std::string &path);
+    int GetFd() const { return fd_; }
+    // Consume the pending events, returning whether one of them is a save of the watched file
+    bool ReadChanges();
+};
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <exception>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 
 // Division by zero error
 class ZeroDivisionException : public std::exception
@@ -26,6 +29,7 @@ struct Vec
     Vec SlipX() const { return {-x, y}; }
     double Norm() const { return std::sqrt(x * x + y * y); }
     double NormSquare() const { return x * x + y * y; }
+    bool IsFinite() const { return std::isfinite(x) && std::isfinite(y); }
     Vec Normalize() const
     {
         double n = Norm();
@@ -48,7 +52,14 @@ using Point = Vec;
 // Zero vector
 const Vec kZeroVec = Vec{0.0, 0.0};
 
-// 2D directed line
+// Tag selecting the constructors of Line and Ray that skip the check of the direction vector
+struct UncheckedDirection
+{
+};
+constexpr UncheckedDirection kUncheckedDirection{};
+
+// 2D directed line; Line, Ray and Segment are trivially copyable and carry no vtable, the bounds of the parameter being
+// checked at compile time according to the type
 class Line
 {
 protected:
@@ -62,11 +73,13 @@ public:
         if (d == kZeroVec)
             throw ZeroDivisionException{};
     }
+    // Construct a directed line without checking the direction vector, which the caller validates instead
+    Line(const Point &s, const Vec &d, UncheckedDirection) noexcept : start_(s), direction_(d) {}
     Vec GetStart() const { return start_; }
     Vec GetDirection() const { return direction_; }
     // Get point s + d * parameter on the directed line
     Vec GetPoint(double parameter) const { return start_ + direction_.Scale(parameter); }
-    virtual bool ParameterWithinBounds(double parameter) const { return true; }
+    static constexpr bool ParameterWithinBounds(double) { return true; }
 };
 
 // 2D ray
@@ -74,7 +87,8 @@ class Ray : public Line
 {
 public:
     Ray(const Point &s, const Vec &d) : Line(s, d){};
-    virtual bool ParameterWithinBounds(double parameter) const override
+    Ray(const Point &s, const Vec &d, UncheckedDirection unchecked) noexcept : Line(s, d, unchecked){};
+    static constexpr bool ParameterWithinBounds(double parameter)
     {
         return (parameter >= 0);
     }
@@ -87,12 +101,14 @@ public:
     // Construct a directed line segment, of which the endpoint is s + d
     Segment(const Point &s, const Vec &d) : Line(s, d){};
     Vec GetEnd() const { return start_ + direction_; }
-    virtual bool ParameterWithinBounds(double parameter) const override
+    static constexpr bool ParameterWithinBounds(double parameter)
     {
         return (parameter >= 0 && parameter <= 1);
     }
 };
 
+static_assert(std::is_trivially_copyable_v<Segment> && sizeof(Segment) == 4 * sizeof(double), "Segment must be a plain pair of vectors");
+
 // Relationships between two directed lines
 struct Intersection
 {
@@ -105,7 +121,99 @@ struct Intersection
     double parameter2;    // Parameter of the intersection point with respect to the second line
 };
 
-// Get the relationships between directed lines
-Intersection GetLineIntersection(const Line &l1, const Line &l2);
+// Get the relationships between directed lines, each of which is a Line, a Ray or a Segment; the parameters are checked against
+// the bounds of the static types of l1 and l2
+template <class L1, class L2>
+Intersection GetLineIntersection(const L1 &l1, const L2 &l2) noexcept
+{
+    static_assert(std::is_base_of_v<Line, L1> && std::is_base_of_v<Line, L2>, "Arguments must be directed lines");
+    Vec d1 = l1.GetDirection();
+    Vec d2 = l2.GetDirection();
+    Vec d1_o = d1.Rotate90Clockwise();
+    Vec d2_o = d2.Rotate90Clockwise();
+    double den1 = d1.Dot(d2_o);
+    double den2 = d2.Dot(d1_o);
+    if (den1 == 0 || den2 == 0)
+        return Intersection{Intersection::ZeroIntersection, 0., 0.};
+    Vec ds21 = l2.GetStart() - l1.GetStart();
+    double t1 = ds21.Dot(d2_o) / den1;
+    double t2 = -ds21.Dot(d1_o) / den2;
+    if (!L1::ParameterWithinBounds(t1) || !L2::ParameterWithinBounds(t2))
+        return Intersection{Intersection::ZeroIntersection, 0., 0.};
+    return Intersection{Intersection::OneIntersection, t1, t2};
+}
+
+// Axis-aligned bounding box
+struct BoundingBox
+{
+    Point min{std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()};
+    Point max{-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+    bool Empty() const { return min.x > max.x || min.y > max.y; }
+    Point Center() const { return (min + max).Scale(0.5); }
+    Vec Extent() const { return max - min; }
+    void Expand(const Point &p)
+    {
+        min = {std::min(min.x, p.x), std::min(min.y, p.y)};
+        max = {std::max(max.x, p.x), std::max(max.y, p.y)};
+    }
+    void Expand(const BoundingBox &b)
+    {
+        Expand(b.min);
+        Expand(b.max);
+    }
+    // Whether b lies within the box; an empty b lies within any box
+    bool Contains(const BoundingBox &b) const { return b.Empty() || (b.min.x >= min.x && b.min.y >= min.y && b.max.x <= max.x && b.max.y <= max.y); }
+    // Grow the box by d on every side
+    void Pad(double d)
+    {
+        min = min - Vec{d, d};
+        max = max + Vec{d, d};
+    }
+    // Clip the ray against the box; on success [t_enter, t_exit] is the parameter interval of the ray inside the box
+    bool Clip(const Ray &ray, double &t_enter, double &t_exit) const { return Clip(ray.GetStart(), ray.GetDirection(), t_enter, t_exit); }
+    // Clip the ray with start point s and direction d, which may be zero
+    bool Clip(const Point &s, const Vec &d, double &t_enter, double &t_exit) const
+    {
+        t_enter = 0.0;
+        t_exit = std::numeric_limits<double>::infinity();
+        return ClipAxis(s.x, d.x, min.x, max.x, t_enter, t_exit) && ClipAxis(s.y, d.y, min.y, max.y, t_enter, t_exit);
+    }
+
+private:
+    static bool ClipAxis(double s, double d, double lo, double hi, double &t_enter, double &t_exit)
+    {
+        if (d == 0.0)
+            return s >= lo && s <= hi;
+        double t1 = (lo - s) / d;
+        double t2 = (hi - s) / d;
+        if (t1 > t2)
+            std::swap(t1, t2);
+        t_enter = std::max(t_enter, t1);
+        t_exit = std::min(t_exit, t2);
+        return t_enter <= t_exit;
+    }
+};
+
+// Bounding box of a directed line segment
+inline BoundingBox GetBoundingBox(const Segment &seg)
+{
+    BoundingBox box;
+    box.Expand(seg.GetStart());
+    box.Expand(seg.GetEnd());
+    return box;
+}
+
+// Relative padding of the boxes used to cull rays, which keeps axis-aligned segments from being missed due to rounding in the
+// slab test
+constexpr double kBoxPadding = 1e-9;
+
+// Bounding box of a directed line segment, padded in proportion to the magnitude of its coordinates
+inline BoundingBox GetPaddedBoundingBox(const Segment &seg)
+{
+    BoundingBox box = GetBoundingBox(seg);
+    double magnitude = std::max({std::abs(box.min.x), std::abs(box.min.y), std::abs(box.max.x), std::abs(box.max.y)});
+    box.Pad(kBoxPadding * (1.0 + magnitude));
+    return box;
+}
 
 #endif
\ No newline at end of file
@@ -4,7 +4,12 @@
 #include "geometry.h"
 #include "optics.h"
 #include "luaapi.h"
+#include "layout.h"
+#include "layoutcache.h"
 #include "utils.h"
+#include "timeline.h"
+#include "segmentgrid.h"
+#include "filewatcher.h"
 #include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
 #include <FL/Fl_Group.H>
@@ -13,8 +18,17 @@
 #include <FL/Fl_Button.H>
 #include <FL/Fl_Box.H>
 #include <FL/fl_draw.H>
+#include <FL/x.H>
 #include <FL/fl_ask.H>
 #include <FL/Fl_File_Chooser.H>
+#include <unordered_set>
+#include <vector>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <cstdint>
 
 class Axis
 {
@@ -36,134 +50,265 @@ public:
         origin_ = (origin_ - center).Scale(s) + center;
     }
     void Move(double dx, double dy) { origin_ = origin_ + Vec(dx, dy); }
+    double GetScale() const { return scale_; }
+    // Make the FLTK transform map field coordinates to window coordinates, as ToWindowCoord does, until fl_pop_matrix; the
+    // vertices of fl_begin_line and its kin are then given in field coordinates
+    void PushTransform() const
+    {
+        fl_push_matrix();
+        fl_translate(origin_.x, origin_.y);
+        fl_scale(scale_, -scale_);
+    }
+};
+
+// Line strips in field coordinates, drawn under Axis::PushTransform; a segment starting where the current strip ends extends
+// it, and a vertex closer than the tolerance to the last one drawn is held back until the strip moves far enough or ends, so
+// that runs of sub-pixel segments collapse into one
+class StripRenderer
+{
+private:
+    double tolerance_square_;
+    bool open_ = false;
+    bool pending_ = false;
+    Point last_drawn_{};
+    Point last_{};
+
+public:
+    explicit StripRenderer(double tolerance) : tolerance_square_(tolerance * tolerance) {}
+    void MoveTo(const Point &p);
+    void LineTo(const Point &p);
+    void AddSegment(const Point &start, const Point &end)
+    {
+        if (!open_ || !(start == last_))
+            MoveTo(start);
+        LineTo(end);
+    }
+    // End the current strip
+    void Flush();
+};
+
+// Level of detail of a rasterization of OpticsBox: the zoom is split into buckets of a quarter octave, and within a bucket
+// details smaller than the tolerance, half a pixel at the lowest zoom of the bucket, are merged
+struct DrawContext
+{
+    static constexpr double kBucketsPerOctave = 4.0;
+
+    const Axis &axis;
+    int zoom_bucket;
+    double tolerance;       // In field coordinates
+    uint64_t generation;    // Simulation whose paths are drawn
+    StripRenderer strips;
+    std::unordered_set<uint64_t> footprints; // Footprints of the rays drawn so far
+
+    DrawContext(const Axis &axis, uint64_t generation);
 };
 
 class Element
 {
 public:
-    virtual void Draw(const Axis &axis) const = 0;
+    // Draw under the transform of Axis::PushTransform, in the color of GetColor set by the caller
+    virtual void Draw(DrawContext &context) const = 0;
+    virtual Fl_Color GetColor() const = 0;
+    // Add the segments drawn by Draw to segments, as belonging to owner
+    virtual void GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const = 0;
+    // Whether the Element changes with each simulation, so that it is drawn on the ray layer of OpticsBox
+    virtual bool IsTraced() const { return false; }
 };
 
 class MirrorElement : public Element, public MirrorDeflector
 {
 public:
     MirrorElement(const Mirror &mirror) : MirrorDeflector(mirror) {}
-    virtual void Draw(const Axis &axis) const override;
+    virtual void Draw(DrawContext &context) const override;
+    virtual Fl_Color GetColor() const override { return FL_BLUE; }
+    virtual void GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const override
+    {
+        segments.push_back({mirror_.seg_.GetStart(), mirror_.seg_.GetEnd(), owner});
+    }
 };
 
 class LensElement : public Element, public LensDeflector
 {
 public:
     LensElement(const Lens &lens) : LensDeflector(lens) {}
-    virtual void Draw(const Axis &axis) const override;
+    virtual void Draw(DrawContext &context) const override;
+    virtual Fl_Color GetColor() const override { return FL_BLACK; }
+    virtual void GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const override
+    {
+        segments.push_back({lens_.seg_.GetStart(), lens_.seg_.GetEnd(), owner});
+    }
 };
 
 class RefractiveElement : public Element, public RefractiveDeflector
 {
 public:
     RefractiveElement(const RefractiveSurface &refractive) : RefractiveDeflector(refractive) {}
-    virtual void Draw(const Axis &axis) const override;
+    virtual void Draw(DrawContext &context) const override;
+    virtual Fl_Color GetColor() const override { return FL_GREEN; }
+    virtual void GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const override
+    {
+        segments.push_back({refractive_.seg_.GetStart(), refractive_.seg_.GetEnd(), owner});
+    }
 };
 
 class LightRayElement : public Element, public LightRay
 {
+private:
+    // Path and final ray decimated for a zoom bucket, with the pixels they cover hashed; vertices starting at split begin a
+    // second strip
+    struct Detail
+    {
+        int zoom_bucket = 0;
+        uint64_t generation = 0;
+        bool valid = false;
+        std::vector<Point> vertices;
+        size_t split = 0;
+        uint64_t footprint = 0;
+    };
+    mutable Detail detail_;
+    bool shown_ = false;
+
+    void UpdateDetail(const DrawContext &context) const;
+
 public:
+    // Length, in field coordinates, of the final ray drawn after the path
+    static constexpr double kTailLength = 20.0;
+
     LightRayElement(Ray ray) : LightRay(ray) {}
-    virtual void Draw(const Axis &axis) const override;
+    virtual void Draw(DrawContext &context) const override;
+    virtual Fl_Color GetColor() const override { return FL_DARK_YELLOW; }
+    virtual void GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const override;
+    virtual bool IsTraced() const override { return true; }
+    // Whether the path traced by the last simulation is final, so that it can be drawn; set on the FLTK thread only
+    void SetShown(bool shown) { shown_ = shown; }
+    bool IsShown() const { return shown_; }
 };
 
-class OpticsBox : public Fl_Widget
+class OpticsBox : public Fl_Widget, public LayoutBuilder
 {
 public:
+    // Damage bits: the optical elements, or the traced rays only, changed and their layer must be rasterized again
+    static constexpr unsigned char kDamageElements = FL_DAMAGE_USER1;
+    static constexpr unsigned char kDamageRays = FL_DAMAGE_USER2;
+    // Distance in pixels from the cursor within which an element is picked
+    static constexpr double kPickRadius = 6.0;
+
     OpticsBox(int x, int y, int w, int h, const char *label);
     ~OpticsBox();
-    void draw() override
-    {
-        Fl_Widget::redraw();
-        draw_box(FL_BORDER_BOX, FL_LIGHT3);
-        fl_push_clip(x(), y(), w(), h());
-        for (auto element : elements_)
-        {
-            element->Draw(axis_);
-        }
-        fl_pop_clip();
-    }
+    // Copy the cached layers to the window, rasterizing again those the damage bits invalidate
+    void draw() override;
     int handle(int event) override;
     void AddElement(std::shared_ptr<Element> e)
     {
         elements_.push_back(e);
     }
-    void RunLuaScript()
+    virtual void AddMirror(const Mirror &mirror) override;
+    virtual void AddLens(const Lens &lens) override;
+    virtual void AddRefractive(const RefractiveSurface &refractive) override;
+    virtual void AddLightRay(const Ray &ray) override;
+    virtual void Reserve(size_t deflectors, size_t light_rays) override
     {
-        try
-        {
-            interpreter_.Run(SelectFile());
-        }
-        catch (LuaExecutionException)
-        {
-            fl_alert("Please check your Lua script!");
-        }
-        catch (ZeroDivisionException)
-        {
-            fl_alert("Please check your Lua script!");
-        }
+        ReserveMore(elements_, deflectors + light_rays);
+        ReserveMore(light_ray_elements_, light_rays);
+        field_.Reserve(deflectors, light_rays);
     }
-    void RunSimulation()
+    // Choose a layout script, then load it as LoadScript does and reload it whenever it is saved
+    void RunLuaScript()
     {
-        try
-        {
-            field_.Simulation();
-        }
-        catch (ZeroDivisionException)
-        {
-            fl_alert("Error occurred during simulation! Please check your Lua script!");
-        }
+        // Choosing the file waits on the user, so it stays out of the timeline
+        std::string file = SelectFile();
+        if (!file.empty())
+            LoadScript(file);
     }
+    // Run the layout script file and show its layout in place of the current one, keeping the LightRays that the script leaves
+    // unchanged and whose paths the changed Deflectors do not cross, and tracing the others; the current layout stays if the
+    // script fails
+    void LoadScript(const std::string &file);
+    // Start tracing the given LightRays of field_, keeping the paths of the others, or all of them, on a background thread,
+    // those starting within the view first, cancelling the simulation running if any; each LightRay is drawn as soon as its
+    // path is final
+    void RunSimulation(std::optional<std::vector<size_t>> light_rays = std::nullopt);
+    // Stop the simulation running, if any, and wait for it; the LightRays it has not shown yet stay hidden
+    void CancelSimulation();
     void Clear()
     {
+        CancelSimulation();
         elements_.clear();
+        records_.clear();
+        light_ray_elements_.clear();
+        fresh_.clear();
         field_.Clear();
+        grid_.Clear();
+        indexed_elements_ = 0;
+        hovered_.reset();
+        selected_.reset();
+        damage(kDamageElements);
     }
+    // Start recording the timeline, or stop and export it to timeline.json in the working directory
+    void ToggleTimeline();
 
 private:
     std::vector<std::shared_ptr<Element>> elements_;
+    std::vector<LayoutRecord> records_;      // The layout elements_ were built from, element by element
+    std::vector<size_t> light_ray_elements_; // Index in elements_ of LightRay i of field_
     LuaInterpreter interpreter_;
+    LayoutCache cache_;
+    // The script loaded last, reloaded once the saves to it settle for kReloadDelay seconds
+    static constexpr double kReloadDelay = 0.1;
+    std::string script_file_;
+    FileWatcher watcher_;
     Field field_;
     Axis axis_;
-};
+    // The background and optical elements, and a copy of it with the traced rays drawn over, which draw copies to the window;
+    // both are w() x h() and drawn with axis_ shifted to their origin
+    Fl_Offscreen element_layer_ = 0;
+    Fl_Offscreen ray_layer_ = 0;
+    int layer_w_ = 0;
+    int layer_h_ = 0;
 
-class LuaUI
-{
-public:
-    static OpticsBox *box_;
-    static Field *field_;
-    static void Bind(OpticsBox *box, Field *field)
-    {
-        LuaUI::box_ = box;
-        LuaUI::field_ = field;
-    }
+    void DeleteLayers();
+    uint64_t generation_ = 0; // Incremented by each simulation, to invalidate the detail cached by LightRayElements
+    // The segments of the first indexed_elements_ Elements, owned by their index, as drawn after the last simulation
+    SegmentGrid grid_;
+    size_t indexed_elements_ = 0;
+    mutable std::vector<bool> indexed_; // Scratch of DrawElements, one flag per indexed Element, all false between calls
+    // The Elements under the cursor and last clicked, which draw highlights
+    std::optional<size_t> hovered_;
+    std::optional<size_t> selected_;
 
-    static void UnBind()
-    {
-        LuaUI::box_ = nullptr;
-        LuaUI::field_ = nullptr;
-    }
-    struct AddMirrorFunctor
-    {
-        void operator()(std::vector<double> ds) const;
-    };
-    struct AddLensFunctor
-    {
-        void operator()(std::vector<double> ds) const;
-    };
-    struct AddRefractiveFunctor
-    {
-        void operator()(std::vector<double> ds) const;
-    };
-    struct AddLightRayFunctor
-    {
-        void operator()(std::vector<double> ds) const;
-    };
+    // The simulation running on simulation_thread_, which hands the LightRays it finishes to the FLTK thread through
+    // published_, waking it with Fl::awake unless a wake-up is already pending
+    std::unique_ptr<SimulationControl> control_;
+    std::thread simulation_thread_;
+    std::mutex published_mutex_;
+    std::vector<size_t> published_;       // Indices in field_ of LightRays finished but not yet shown
+    bool simulation_done_ = false;        // Guarded by published_mutex_, like simulation_error_
+    std::exception_ptr simulation_error_;
+    std::atomic<bool> awake_pending_{false};
+    std::vector<size_t> fresh_;           // Index in elements_ of the LightRays shown since the ray layer was last drawn
+
+    static void OnScriptEvent(int fd, void *data);
+    static void OnScriptSaved(void *data);
+    // Replace the layout with records, as LoadScript describes
+    void ApplyLayout(const std::vector<LayoutRecord> &records);
+    // Called on simulation_thread_ when there is something for the FLTK thread
+    void Wake();
+    static void OnAwake(void *data);
+    // Show the published LightRays and, once the simulation is done, index them and report its error if any
+    void CollectPublished();
+    // Visible part of the field, in field coordinates
+    BoundingBox GetView() const;
+    // Index the segments of every Element
+    void BuildIndex();
+    // Draw the Elements of the ray layer if traced, else those of the element layer, one color at a time; only the indexed
+    // Elements within the layer of size w x h are drawn, along with any added since the index was built
+    void DrawElements(const Axis &axis, bool traced, int w, int h) const;
+    // Draw elements_[i] for each i of indices, one color at a time
+    void DrawIndexed(const Axis &axis, const std::vector<size_t> &indices) const;
+    // Draw a wide line over the segments of elements_[index] in color
+    void DrawHighlight(size_t index, Fl_Color color) const;
+    // Index of the Element nearest to the window point (x, y) within kPickRadius
+    std::optional<size_t> Pick(int x, int y) const;
 };
 
 #endif
\ No newline at end of file
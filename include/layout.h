@@ -0,0 +1,70 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "geometry.h"
+#include "optics.h"
+#include "luaapi.h"
+#include <vector>
+#include <memory>
+
+// Receiver of the optical elements and light rays described by a layout script
+class LayoutBuilder
+{
+public:
+    virtual void AddMirror(const Mirror &mirror) = 0;
+    virtual void AddLens(const Lens &lens) = 0;
+    virtual void AddRefractive(const RefractiveSurface &refractive) = 0;
+    virtual void AddLightRay(const Ray &ray) = 0;
+    // Hint that the given numbers of optical elements and of light rays, in this order, are about to be added
+    virtual void Reserve(size_t, size_t) {}
+};
+
+// Builds a layout straight into a Field, without anything to display it
+class FieldBuilder : public LayoutBuilder
+{
+private:
+    Field *field_;
+
+public:
+    FieldBuilder(Field &field) : field_(&field) {}
+    virtual void AddMirror(const Mirror &mirror) override { field_->AddDeflector(std::make_shared<MirrorDeflector>(mirror)); }
+    virtual void AddLens(const Lens &lens) override { field_->AddDeflector(std::make_shared<LensDeflector>(lens)); }
+    virtual void AddRefractive(const RefractiveSurface &refractive) override { field_->AddDeflector(std::make_shared<RefractiveDeflector>(refractive)); }
+    virtual void AddLightRay(const Ray &ray) override { field_->AddLightRay(std::make_shared<LightRay>(ray)); }
+    virtual void Reserve(size_t deflectors, size_t light_rays) override { field_->Reserve(deflectors, light_rays); }
+};
+
+// The Lua functions of layout scripts, which hand the elements they describe to the bound LayoutBuilder
+class LuaLayout
+{
+public:
+    static LayoutBuilder *builder_;
+    static void Bind(LayoutBuilder *builder) { LuaLayout::builder_ = builder; }
+    static void UnBind() { LuaLayout::builder_ = nullptr; }
+    // Register add_mirror, add_lens, add_refractive, add_lightray and the bulk functions with the interpreter
+    static void Register(LuaInterpreter &interpreter);
+
+    // add_refractive_polyline(xs, ys, n_left, n_right): refractive surfaces from (xs[i], ys[i]) to (xs[i + 1], ys[i + 1])
+    static int AddRefractivePolyline(lua_State *L);
+    // add_lightrays(rays): a light ray for each entry {start_x, start_y, direction_x, direction_y} of the array rays
+    static int AddLightRays(lua_State *L);
+
+    struct AddMirrorFunctor
+    {
+        void operator()(double start_x, double start_y, double end_x, double end_y) const;
+    };
+    struct AddLensFunctor
+    {
+        void operator()(double start_x, double start_y, double end_x, double end_y, double focal_length) const;
+    };
+    struct AddRefractiveFunctor
+    {
+        void operator()(double start_x, double start_y, double end_x, double end_y, double n_left, double n_right) const;
+    };
+    struct AddLightRayFunctor
+    {
+        void operator()(double start_x, double start_y, double direction_x, double direction_y) const;
+    };
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef LAYOUTCACHE_H
+#define LAYOUTCACHE_H
+
+#include "layout.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <cstdint>
+
+// An optical element or light ray added by a layout script, in the fixed-size form stored by the LayoutCache
+struct LayoutRecord
+{
+    enum Kind : uint32_t
+    {
+        MirrorRecord,
+        LensRecord,
+        RefractiveRecord,
+        LightRayRecord
+    };
+    uint32_t kind;
+    uint32_t reserved;
+    // Start and direction of the segment or ray, then the focal length or the refractive indices
+    double values[6];
+};
+
+// Records the layout built by a script, optionally passing every element on to another LayoutBuilder as well
+class LayoutRecorder : public LayoutBuilder
+{
+private:
+    LayoutBuilder *forward_;
+    std::vector<LayoutRecord> records_;
+
+public:
+    explicit LayoutRecorder(LayoutBuilder *forward = nullptr) : forward_(forward) {}
+    virtual void AddMirror(const Mirror &mirror) override;
+    virtual void AddLens(const Lens &lens) override;
+    virtual void AddRefractive(const RefractiveSurface &refractive) override;
+    virtual void AddLightRay(const Ray &ray) override;
+    virtual void Reserve(size_t deflectors, size_t light_rays) override;
+    const std::vector<LayoutRecord> &GetRecords() const { return records_; }
+};
+
+// Add the recorded elements to builder, in the order they were recorded
+void ReplayLayout(const LayoutRecord *records, size_t count, LayoutBuilder &builder);
+
+// Binary files of recorded layouts, named after the hash of the script that built them so that an unchanged script is loaded,
+// by mapping its file, instead of being run again. The key covers the content of the script only: a script that reads other
+// files or random numbers must be run with the cache disabled
+class LayoutCache
+{
+private:
+    std::filesystem::path directory_;
+
+public:
+    // Number of layouts kept; Store removes the least recently used beyond it
+    static constexpr size_t kMaxEntries = 64;
+
+    // A cache in directory; an empty directory disables the cache
+    explicit LayoutCache(std::filesystem::path directory) : directory_(std::move(directory)) {}
+    // $OPTSIM_CACHE_DIR if set, possibly empty to disable the cache, else optsim in $XDG_CACHE_HOME or ~/.cache
+    static std::filesystem::path GetDefaultDirectory();
+    // Hash of the content of script_file, or nothing if it cannot be read
+    static std::optional<uint64_t> HashScript(const std::string &script_file);
+
+    bool IsEnabled() const { return !directory_.empty(); }
+    // Add the layout cached under key to builder; false, without adding anything, if there is no valid cached layout
+    bool Load(uint64_t key, LayoutBuilder &builder) const;
+    // Cache the recorded layout under key, then evict the layouts beyond kMaxEntries; false if it cannot be written
+    bool Store(uint64_t key, const LayoutRecorder &recorder) const;
+
+private:
+    std::filesystem::path GetPath(uint64_t key) const;
+    // Remove the cached layouts beyond kMaxEntries, the least recently stored or loaded first
+    void Evict() const;
+};
+
+// Add the layout of script_file to builder, loading it from cache if the script is unchanged since it was cached, or else
+// running it with interpreter and caching the result; returns whether the layout came from the cache. Throws what the
+// script throws
+bool RunLayoutScript(LuaInterpreter &interpreter, const std::string &script_file, LayoutBuilder &builder, const LayoutCache &cache);
+
+#endif
@@ -10,10 +10,19 @@ extern "C"
 
 #include <string>
 #include <vector>
+#include <tuple>
+#include <utility>
+#include <exception>
 #include <type_traits>
 
 class LuaExecutionException : public std::exception
 {
+private:
+    std::string message_;
+
+public:
+    LuaExecutionException(std::string message = "Lua execution error") : message_(std::move(message)) {}
+    const char *what() const noexcept override { return message_.c_str(); }
 };
 
 // Abstraction of a Lua interpreter
@@ -28,58 +37,136 @@ public:
         luaL_openlibs(L);
     }
 
+    // Run a script; a C++ exception thrown by a callback is rethrown here, any other error throws LuaExecutionException
     void Run(const std::string &script_file)
     {
+        // An exception left by a callback whose error the script caught with pcall must not be blamed for a later error
+        pending_exception_ = nullptr;
         if (luaL_loadfile(L, script_file.c_str()) || lua_pcall(L, 0, 0, 0))
-            throw LuaExecutionException();
+        {
+            std::string message = lua_isstring(L, -1) ? lua_tostring(L, -1) : "Lua execution error";
+            lua_pop(L, 1);
+            if (pending_exception_ != nullptr)
+                std::rethrow_exception(std::exchange(pending_exception_, nullptr));
+            throw LuaExecutionException(message);
+        }
+        pending_exception_ = nullptr;
     }
 
-    // Register Lua functions as functors, requiring the return type to be void and the parameter to be std::vector<double>
+    // Register Lua functions as functors returning void. A functor taking std::vector<double> receives every argument; any
+    // other functor takes a fixed number of numbers, e.g. void(double, double, double, double), read straight off the Lua stack
     template <class CallbackFunctor>
     void RegisterLuaFunction(const std::string &lua_function_name)
     {
-        static_assert(FunctorTraits<CallbackFunctor, void, std::vector<double>>::valid, "Function Type Error");
-        lua_register(L, lua_function_name.c_str(), GetWrapper<CallbackFunctor>());
+        if constexpr (std::is_invocable_r_v<void, CallbackFunctor, std::vector<double>>)
+            lua_register(L, lua_function_name.c_str(), GetVectorWrapper<CallbackFunctor>());
+        else
+        {
+            using Arguments = typename FunctorTraits<CallbackFunctor>::Arguments;
+            static_assert(FunctorTraits<CallbackFunctor>::valid, "Function Type Error");
+            lua_register(L, lua_function_name.c_str(), GetFixedWrapper<CallbackFunctor>(Arguments{}));
+        }
+    }
+
+    // Register a Lua function that reads its arguments from the Lua stack itself, e.g. to walk Lua arrays without copying them
+    void RegisterLuaCFunction(const std::string &lua_function_name, lua_CFunction function)
+    {
+        lua_register(L, lua_function_name.c_str(), function);
+    }
+
+    // Call f from a Lua function, turning a C++ exception thrown by f into a Lua error so that it does not unwind through the
+    // C frames of Lua; Run rethrows the exception once the script is unwound
+    template <class F>
+    static int ProtectedCall(lua_State *L, F &&f)
+    {
+        try
+        {
+            return f();
+        }
+        catch (const std::exception &)
+        {
+            pending_exception_ = std::current_exception();
+        }
+        // Raise the error outside the handler, which longjmp must not leave
+        return luaL_error(L, "%s", "C++ exception in callback");
     }
 
     ~LuaInterpreter() { lua_close(L); }
 
 private:
     lua_State *L;
+    static inline thread_local std::exception_ptr pending_exception_;
 
-    // Class template used to check the functor type
-    template <typename Functor, typename ReturnType, typename... Args>
-    struct FunctorTraits
+    template <class... Args>
+    struct ArgumentList
+    {
+    };
+
+    // Parameter list of the call operator of a functor, which must take numbers only
+    template <typename Functor>
+    struct FunctorTraits : FunctorTraits<decltype(&Functor::operator())>
+    {
+    };
+    template <typename C, typename ReturnType, typename... Args>
+    struct FunctorTraits<ReturnType (C::*)(Args...) const>
+    {
+        using Arguments = ArgumentList<Args...>;
+        static constexpr bool valid = std::is_void_v<ReturnType> && (std::is_arithmetic_v<std::decay_t<Args>> && ...);
+    };
+    template <typename C, typename ReturnType, typename... Args>
+    struct FunctorTraits<ReturnType (C::*)(Args...)> : FunctorTraits<ReturnType (C::*)(Args...) const>
     {
-        static constexpr bool valid = std::is_invocable_r_v<ReturnType, Functor, Args...>;
     };
 
     template <class CallbackFunctor>
-    CallbackFunctionWrapper GetWrapper()
+    static CallbackFunctionWrapper GetVectorWrapper()
     {
         return [](lua_State *L) -> int
         {
             // Get the number of parameters
             int num_args = lua_gettop(L);
 
-            // Construct the parameter list
-            std::vector<double> args;
+            // Check the parameters before allocating, as a Lua error skips the destructors
             for (int i = 1; i <= num_args; ++i)
-            {
                 if (!lua_isnumber(L, i))
-                {
-                    throw LuaExecutionException();
-                }
-                double arg = lua_tonumber(L, i);
-                args.push_back(arg);
-            }
+                    return luaL_argerror(L, i, "number expected");
+
+            return ProtectedCall(L, [&]
+                                 {
+                                     // Construct the parameter list
+                                     std::vector<double> args;
+                                     args.reserve(num_args);
+                                     for (int i = 1; i <= num_args; ++i)
+                                         args.push_back(lua_tonumber(L, i));
 
-            // Invoke the callback function
-            CallbackFunctor()(args);
+                                     // Invoke the callback function
+                                     CallbackFunctor()(std::move(args));
+                                     return 0; });
+        };
+    }
 
-            return 0;
+    template <class CallbackFunctor, class... Args>
+    static CallbackFunctionWrapper GetFixedWrapper(ArgumentList<Args...>)
+    {
+        return [](lua_State *L) -> int
+        {
+            constexpr int arity = sizeof...(Args);
+            if (lua_gettop(L) != arity)
+                return luaL_error(L, "expected %d arguments, got %d", arity, lua_gettop(L));
+            return Invoke<CallbackFunctor, Args...>(L, std::index_sequence_for<Args...>{});
         };
     }
+
+    template <class CallbackFunctor, class... Args, size_t... I>
+    static int Invoke(lua_State *L, std::index_sequence<I...>)
+    {
+        // The braced list reads the arguments in order, so that the first bad one is reported
+        std::tuple<std::decay_t<Args>...> args{static_cast<std::decay_t<Args>>(luaL_checknumber(L, static_cast<int>(I) + 1))...};
+        return ProtectedCall(L, [&]
+                             {
+                                 CallbackFunctor()(std::get<I>(args)...);
+                                 return 0; });
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file, unmapped on destruction; the pages are loaded by the kernel as they are touched
+class MappedFile
+{
+private:
+    const void *data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    MappedFile() = default;
+    // Map path; IsOpen is false if it cannot be opened or mapped
+    explicit MappedFile(const std::string &path);
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    bool IsOpen() const { return data_ != nullptr; }
+    const void *GetData() const { return data_; }
+    size_t GetSize() const { return size_; }
+};
+
+#endif
@@ -2,8 +2,26 @@
 #define OPTICS_H
 
 #include "geometry.h"
+#include "bvh.h"
+#include "threadpool.h"
+#include "arena.h"
 #include <vector>
 #include <memory>
+#include <variant>
+#include <array>
+#include <cstdint>
+#include <algorithm>
+#include <optional>
+#include <atomic>
+#include <functional>
+
+// Make room for more elements in v, growing it geometrically so that many small reservations do not reallocate it every time
+template <class T>
+void ReserveMore(std::vector<T> &v, size_t more)
+{
+    if (v.size() + more > v.capacity())
+        v.reserve(std::max(v.size() + more, 2 * v.capacity()));
+}
 
 // State of the LightRay incident on the Deflector
 struct IncidenceState
@@ -11,45 +29,70 @@ struct IncidenceState
     Intersection intersection; // Info about the intersection point between the Deflector and the LightRay
     bool termination = false;  // Whether the Deflector terminates the propagation of the LightRay
     Vec ray_direction;         // The direction of the incident light ray
-    Intersection::NumIntersects GetNumIntersects() { return intersection.num_intersects; }
-    double GetRayParameter() { return intersection.parameter1; }
-    double GetDeflectorParameter() { return intersection.parameter2; }
+    Intersection::NumIntersects GetNumIntersects() const { return intersection.num_intersects; }
+    double GetRayParameter() const { return intersection.parameter1; }
+    double GetDeflectorParameter() const { return intersection.parameter2; }
 };
 
 class LightRay;
+class Deflector;
+class Scene;
+class PathStream;
+class RaySource;
 
-// Deflector interface, an abstraction for actual optical elements
-class Deflector
+// Deflector rejected when a Scene is compiled, as tracing it would divide by zero or produce invalid rays
+class InvalidDeflectorException : public std::exception
 {
+private:
+    size_t index_;
+    const char *reason_;
+
 public:
-    Deflector() {}
-    // Incident calculation, with the parameter light_ray as a reserved parameter; ray represents the ray corresponding to the incident light, returning the incidence state
-    virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const = 0;
-    // Emission calculation, with the parameter light_ray as a reserved parameter; s represents the incident state and returns the outgoing ray
-    virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const = 0;
+    InvalidDeflectorException(size_t index, const char *reason) : index_(index), reason_(reason) {}
+    // Index of the Deflector in the order it was added to the Field
+    size_t GetIndex() const { return index_; }
+    const char *what() const noexcept override { return reason_; }
 };
 
-// LightRay class, an abstraction for light path
-class LightRay
+// Why a LightRay stopped propagating
+enum class RayStatus
 {
-protected:
-    std::vector<Segment> path_;                          // The historical path of the LightRay
-    Ray ray_;                                            // The ray at the end of the LightRay path
-    Ray init_ray_;
-    std::vector<std::shared_ptr<Deflector>> deflectors_; // All Deflectors involved in the light path calculation
-    size_t excluded_deflector_;                          // Exclude the most recently encountered Deflector
+    Propagating, // Still being traced
+    Escaped,     // Hit no further Deflector
+    Absorbed,    // Stopped by a terminating Deflector
+    StepLimit,   // Ran out of steps
+    Attenuated,  // Energy fell below the minimum of the simulation
+    Trapped,     // Returned exactly to an earlier state, so that it would repeat the same orbit forever
+    Degenerate   // A Deflector produced no valid outgoing ray, or a custom Deflector threw
+};
 
-public:
-    LightRay(Ray ray) : ray_(ray), init_ray_(ray), excluded_deflector_(-1) {}
-    // Perform a propagation calculation, which will determine which Deflector's emission calculation to invoke, returning whether the LightRay can continue to propagate
-    bool Step();
-    void Reset(const std::vector<std::shared_ptr<Deflector>> &deflectors)
-    {
-        deflectors_ = deflectors;
-        excluded_deflector_ = -1;
-        ray_ = init_ray_;
-        path_.clear();
-    }
+constexpr size_t kRayStatusCount = 7;
+
+// Lower-case name of the status, as written by the headless executable
+const char *GetRayStatusName(RayStatus status);
+
+// Counters of a simulation, gathered by Field::Simulation when SetCollectStats is on; each thread fills its own SimulationStats,
+// which are merged once the LightRays are traced
+struct alignas(64) SimulationStats
+{
+    uint64_t rays = 0;
+    uint64_t intersection_tests = 0;                   // Tests of a ray against a Deflector, summed over deflector_tests
+    uint64_t hits = 0;                                 // Nearest Deflectors found, summed over deflector_hits
+    uint64_t bounces = 0;                              // Deflections of all LightRays
+    uint64_t max_bounces = 0;                          // Most deflections of a single LightRay
+    std::array<uint64_t, kRayStatusCount> terminations{}; // Number of LightRays by the RayStatus they stopped with
+    std::vector<uint64_t> bounce_histogram;            // LightRays by std::bit_width of their deflections: element 0 counts
+                                                       // the LightRays never deflected, element k those deflected
+                                                       // [2^(k-1), 2^k) times
+    std::vector<uint64_t> deflector_tests;             // Tests against each Deflector of the Scene
+    std::vector<uint64_t> deflector_hits;              // Times each Deflector of the Scene was the nearest one hit
+
+    // Clear the counters, for a Scene of deflector_count Deflectors
+    void Reset(size_t deflector_count);
+    // Count a LightRay that stopped after bounces deflections
+    void AddRay(RayStatus status, size_t bounces);
+    // Add the counters of other, gathered on the same Scene
+    void Merge(const SimulationStats &other);
 };
 
 struct Mirror
@@ -75,6 +118,202 @@ struct Wall
     Segment seg_;
 };
 
+// Mirror with the quantities needed at every hit computed once
+struct CompiledMirror
+{
+    Segment seg_;
+    Vec normal_; // Unit normal, pointing to the left of the segment
+    explicit CompiledMirror(const Mirror &mirror);
+};
+
+// Lens with the quantities needed at every hit computed once
+struct CompiledLens
+{
+    Segment seg_;
+    Vec tangent_;             // Unit tangent
+    Vec normal_;              // Unit normal, pointing to the left of the segment
+    double length_;           // Length of the lens
+    double half_length_;      // Distance from an end to the optical center
+    double focal_length_;
+    double inv_focal_length_; // Reciprocal of the focal length, infinite for a zero focal length
+    explicit CompiledLens(const Lens &lens);
+};
+
+// RefractiveSurface with the quantities needed at every hit computed once
+struct CompiledRefractiveSurface
+{
+    Segment seg_;
+    Vec tangent_;             // Unit tangent
+    Vec normal_;              // Unit normal, pointing to the left of the surface
+    double n_left_;
+    double n_right_;
+    double ratio_from_left_;  // n_left_ / n_right_, the ratio applied to rays coming from the left
+    double ratio_from_right_; // n_right_ / n_left_, the ratio applied to rays coming from the right
+    explicit CompiledRefractiveSurface(const RefractiveSurface &refractive);
+};
+
+// Deflector without a built-in compiled form, traced through its virtual interface
+struct CustomDeflector
+{
+    const Deflector *deflector_;
+};
+
+// Compiled form of a Deflector, stored by value in a contiguous array and traced by the kernel of its type
+using CompiledDeflector = std::variant<CompiledMirror, CompiledLens, CompiledRefractiveSurface, Wall, CustomDeflector>;
+
+// Deflector interface, an abstraction for actual optical elements
+class Deflector
+{
+public:
+    Deflector() {}
+    // Incident calculation, with the parameter light_ray as a reserved parameter; ray represents the ray corresponding to the incident light, returning the incidence state
+    virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const = 0;
+    // Emission calculation, with the parameter light_ray as a reserved parameter; s represents the incident state and returns the outgoing ray
+    virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const = 0;
+    // The segment occupied by the Deflector, used to build the acceleration structures; Incidence must report exactly the
+    // intersection of the ray with this segment
+    virtual Segment GetSegment() const = 0;
+    // The compiled form traced by Field::Simulation; the default calls back into Incidence and Emergence
+    virtual CompiledDeflector Compile() const { return CustomDeflector{this}; }
+};
+
+// Tracing kernels of the built-in Deflectors, shared by the Deflector classes and the compiled scene; they expect Deflectors
+// accepted by the validation of the Scene, and leave the check of the outgoing direction to the caller
+IncidenceState ComputeIncidence(const CompiledMirror &mirror, const Ray &ray) noexcept;
+Ray ComputeEmergence(const CompiledMirror &mirror, const IncidenceState &s) noexcept;
+IncidenceState ComputeIncidence(const CompiledLens &lens, const Ray &ray) noexcept;
+Ray ComputeEmergence(const CompiledLens &lens, const IncidenceState &s) noexcept;
+IncidenceState ComputeIncidence(const CompiledRefractiveSurface &refractive, const Ray &ray) noexcept;
+Ray ComputeEmergence(const CompiledRefractiveSurface &refractive, const IncidenceState &s) noexcept;
+IncidenceState ComputeIncidence(const Wall &wall, const Ray &ray) noexcept;
+Ray ComputeEmergence(const Wall &wall, const IncidenceState &s) noexcept;
+// Fraction of the energy of unpolarized light carried by the ray leaving the surface, from the Fresnel equations; 1 for a
+// total internal reflection
+double ComputeTransmittance(const CompiledRefractiveSurface &refractive, const IncidenceState &s) noexcept;
+
+// LightRay class, an abstraction for light path
+class LightRay
+{
+protected:
+    PathView path_;                                      // The historical path of the LightRay, as the points at which it started and was deflected
+    Ray ray_;                                            // The ray at the end of the LightRay path
+    Ray init_ray_;
+    double init_energy_;
+    PathArena::Writer *writer_;                          // Records the path while the LightRay is traced
+    size_t excluded_deflector_;                          // Exclude the most recently encountered Deflector
+    double energy_;                                      // Fraction of the initial energy left
+    RayStatus status_;
+    size_t bounces_;                                     // Deflections since the last Reset
+    SimulationStats *stats_;                             // Counters of the current simulation, or nullptr if not collected
+
+    // Find the nearest Deflector of the scene hit by ray_ by testing every Deflector
+    bool FindNearestLinear(const Scene &scene, size_t &nearest_i, IncidenceState &nearest_s);
+    // Find the nearest Deflector of the scene hit by ray_ by traversing its hierarchy
+    bool FindNearestHierarchical(const Scene &scene, size_t &nearest_i, IncidenceState &nearest_s);
+
+public:
+    LightRay(Ray ray, double energy = 1.0) : ray_(ray), init_ray_(ray), init_energy_(energy), writer_(nullptr), excluded_deflector_(-1), energy_(energy), status_(RayStatus::Propagating), bounces_(0), stats_(nullptr) {}
+    // Perform a propagation calculation against the Deflectors of the scene, which will determine which Deflector's emission calculation to invoke, returning whether the LightRay can continue to propagate
+    bool Step(const Scene &scene);
+    // Incidence calculation of the current ray on Deflector i of the scene; a custom Deflector that throws stops the LightRay
+    // instead of the simulation
+    IncidenceState GetIncidence(const Scene &scene, size_t i);
+    // Incidence calculation on Deflector i of the scene, whose intersection with the current ray is already known; only a custom
+    // Deflector computes it again
+    IncidenceState GetIncidence(const Scene &scene, size_t i, const Intersection &intersection);
+    // Propagate the LightRay to Deflector i of the scene, whose incidence state is s, returning whether the LightRay can continue to propagate
+    bool Deflect(const Scene &scene, size_t i, const IncidenceState &s);
+    const Ray &GetRay() const { return ray_; }
+    // The ray the LightRay starts from at each Reset
+    const Ray &GetInitialRay() const { return init_ray_; }
+    size_t GetExcludedDeflector() const { return excluded_deflector_; }
+    double GetEnergy() const { return energy_; }
+    RayStatus GetStatus() const { return status_; }
+    size_t GetBounces() const { return bounces_; }
+    // Record why the LightRay stops; the first reason recorded since the last Reset is kept
+    void Stop(RayStatus status)
+    {
+        if (status_ == RayStatus::Propagating)
+            status_ = status;
+    }
+    // The path traced by the last simulation, valid until the next one
+    const PathView &GetPath() const { return path_; }
+    // Reset the LightRay to its initial ray and start recording its path with writer, and counting its work in stats unless it
+    // is nullptr
+    void Reset(PathArena::Writer &writer, SimulationStats *stats = nullptr)
+    {
+        excluded_deflector_ = -1;
+        energy_ = init_energy_;
+        status_ = RayStatus::Propagating;
+        // A LightRay from unchecked input, such as a RaySource, that cannot be traced stops right away
+        if (!init_ray_.GetStart().IsFinite() || !init_ray_.GetDirection().IsFinite() || init_ray_.GetDirection() == kZeroVec ||
+            !(init_energy_ >= 0.0) || !std::isfinite(init_energy_))
+            status_ = RayStatus::Degenerate;
+        bounces_ = 0;
+        stats_ = stats;
+        ray_ = init_ray_;
+        path_ = PathView{};
+        writer_ = &writer;
+        writer_->Begin();
+        writer_->Push(ray_.GetStart());
+    }
+    // Stop tracing and publish the recorded path; a LightRay still propagating has run out of steps
+    void Finish()
+    {
+        Stop(RayStatus::StepLimit);
+        path_ = writer_->End();
+        writer_ = nullptr;
+        if (stats_ != nullptr)
+            stats_->AddRay(status_, bounces_);
+        stats_ = nullptr;
+    }
+    // Forget the published path, whose vertices were given back to the Writer that recorded them
+    void DiscardPath() { path_ = PathView{}; }
+};
+
+// Brent's cycle detection over the states of a LightRay, which finds a periodic orbit within a few periods of entering it with
+// a single saved state; as tracing is deterministic, a LightRay back in the exact same state repeats its orbit forever, provided
+// custom Deflectors depend on the incident ray only
+class CycleDetector
+{
+private:
+    Point start_;
+    Vec direction_;
+    size_t deflector_;
+    size_t power_;
+    size_t length_;
+
+    void Save(const LightRay &light_ray)
+    {
+        start_ = light_ray.GetRay().GetStart();
+        direction_ = light_ray.GetRay().GetDirection();
+        deflector_ = light_ray.GetExcludedDeflector();
+    }
+
+public:
+    // Start watching a LightRay from its current state
+    void Reset(const LightRay &light_ray)
+    {
+        Save(light_ray);
+        power_ = 1;
+        length_ = 0;
+    }
+    // Record the state reached by the LightRay after a step, returning whether it was seen before
+    bool Visit(const LightRay &light_ray)
+    {
+        const Ray &ray = light_ray.GetRay();
+        if (ray.GetStart() == start_ && ray.GetDirection() == direction_ && light_ray.GetExcludedDeflector() == deflector_)
+            return true;
+        if (++length_ == power_)
+        {
+            Save(light_ray);
+            power_ *= 2;
+            length_ = 0;
+        }
+        return false;
+    }
+};
+
 class MirrorDeflector : public Deflector
 {
 protected:
@@ -84,6 +323,8 @@ public:
     MirrorDeflector(const Mirror &mirror) : mirror_(mirror) {}
     virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const override;
     virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const override;
+    virtual Segment GetSegment() const override { return mirror_.seg_; }
+    virtual CompiledDeflector Compile() const override { return CompiledMirror(mirror_); }
 };
 
 class LensDeflector : public Deflector
@@ -95,6 +336,8 @@ public:
     LensDeflector(const Lens &lens) : lens_(lens) {}
     virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const override;
     virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const override;
+    virtual Segment GetSegment() const override { return lens_.seg_; }
+    virtual CompiledDeflector Compile() const override { return CompiledLens(lens_); }
 };
 
 class RefractiveDeflector : public Deflector
@@ -106,6 +349,8 @@ public:
     RefractiveDeflector(const RefractiveSurface &refractive) : refractive_(refractive) {}
     virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const override;
     virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const override;
+    virtual Segment GetSegment() const override { return refractive_.seg_; }
+    virtual CompiledDeflector Compile() const override { return CompiledRefractiveSurface(refractive_); }
 };
 
 class WallDeflector : public Deflector
@@ -117,6 +362,63 @@ public:
     WallDeflector(const Wall &wall) : wall_(wall) {}
     virtual IncidenceState Incidence(LightRay &light_ray, Ray ray) const override;
     virtual Ray Emergence(LightRay &light_ray, IncidenceState s) const override;
+    virtual Segment GetSegment() const override { return wall_.seg_; }
+    virtual CompiledDeflector Compile() const override { return wall_; }
+};
+
+// Method used by LightRay::Step to find the nearest Deflector
+enum class IntersectionMode
+{
+    LinearScan,             // Test every Deflector, kept as the reference implementation
+    BoundingVolumeHierarchy // Traverse a hierarchy built over the Deflector segments
+};
+
+// Immutable snapshot of the Deflectors of a Field, compiled once and traced by reference by every LightRay; the Deflectors are
+// validated while compiling, so that tracing never throws, and an InvalidDeflectorException reports the first rejected one
+class Scene
+{
+private:
+    std::vector<std::shared_ptr<Deflector>> sources_; // Keeps the Deflectors referred to by CustomDeflector alive
+    std::vector<CompiledDeflector> compiled_;
+    std::vector<Segment> segments_;
+    SegmentBVH bvh_;
+    BoundingBox bounds_;
+    bool hierarchical_;
+
+public:
+    Scene(const std::vector<std::shared_ptr<Deflector>> &deflectors, IntersectionMode mode);
+    size_t Size() const { return compiled_.size(); }
+    const CompiledDeflector &GetDeflector(size_t i) const { return compiled_[i]; }
+    const std::vector<Segment> &GetSegments() const { return segments_; }
+    // The hierarchy over the segments, or nullptr if the Deflectors are scanned linearly
+    const SegmentBVH *GetBVH() const { return hierarchical_ ? &bvh_ : nullptr; }
+    // Bounds of all Deflectors; a ray that misses them hits nothing
+    const BoundingBox &GetBounds() const { return bounds_; }
+};
+
+// Limits applied to every LightRay by Field::Simulation
+struct SimulationOptions
+{
+    size_t max_bounces = 1000; // Steps traced per LightRay, at least one; a step ends in a deflection or in the end of the LightRay
+    double min_energy = 0.0;   // A LightRay stops once its energy falls below this; energy is only lost by refraction
+    bool detect_cycles = true; // Stop LightRays trapped in a periodic orbit instead of tracing them up to max_bounces
+};
+
+// Steering of a run of Field::Simulation, made by a thread that wants the LightRays it looks at first and may give up on the rest
+struct SimulationControl
+{
+    // Order in which the LightRays are traced, a permutation of the indices [0, order.size()) of Field::GetLightRays; the
+    // others follow in their own order. The first priority_count of them are traced, by every thread, before any other starts
+    std::vector<size_t> order;
+    size_t priority_count = 0;
+    // Trace only the LightRays of order, leaving the others, and their paths, as the last Simulation left them; the paths of
+    // every run since the last full one are then kept in memory, until Field::ShouldRetraceAll asks for a full one
+    bool keep_others = false;
+    // Set from any thread to stop the run; LightRays being traced are finished, and those not yet started are left as they were,
+    // with paths that must not be read before the next Simulation
+    std::atomic<bool> cancel{false};
+    // Called on the tracing thread with the index in Field::GetLightRays of each LightRay once its path is final
+    std::function<void(size_t)> on_finish;
 };
 
 class Field
@@ -124,21 +426,104 @@ class Field
 private:
     std::vector<std::shared_ptr<LightRay>> light_rays_;
     std::vector<std::shared_ptr<Deflector>> deflectors_;
+    IntersectionMode intersection_mode_ = IntersectionMode::BoundingVolumeHierarchy;
+    std::shared_ptr<const Scene> scene_; // Snapshot of deflectors_, rebuilt by Simulation after they change
+    PathArena arena_;                    // Vertices of the paths of light_rays_
+    size_t arena_vertices_ = 0;          // Vertices of the paths written to arena_ since its last reset, live or not
+    size_t thread_count_ = 1;
+    std::unique_ptr<ThreadPool> pool_;
+    bool packet_tracing_ = false;
+    SimulationOptions options_;
+    bool collect_stats_ = false;
+    SimulationStats stats_;
+    PathStream *path_stream_ = nullptr;
+    std::shared_ptr<const RaySource> ray_source_;
+    SimulationControl *control_ = nullptr; // Of the Simulation running
+
+    // The LightRay traced n-th according to control_
+    size_t GetTraceIndex(size_t n) const { return control_ != nullptr && n < control_->order.size() ? control_->order[n] : n; }
+    bool IsCancelled() const { return control_ != nullptr && control_->cancel.load(std::memory_order_relaxed); }
+    // Check light_ray against options_ after its step number steps, returning whether it can continue to propagate
+    bool WithinLimits(LightRay &light_ray, CycleDetector &cycle, size_t steps) const;
+    // The LightRays traced by Simulation are numbered light_rays_ first, then the rays of ray_source_. Get LightRay i, which
+    // for a ray of ray_source_ is built in scratch
+    LightRay &GetLightRay(size_t i, std::optional<LightRay> &scratch) const;
+    // Trace LightRay i on thread thread_id until it stops or runs out of steps, counting its work in stats unless it is nullptr
+    void Trace(size_t i, const Scene &scene, PathArena::Writer &writer, SimulationStats *stats, size_t thread_id) const;
+    // Trace the LightRays numbered [begin, end) in the order of control_ in RayPackets, grouping LightRays of close initial rays in
+    // a packet and refilling a lane with the next LightRay as soon as its LightRay stops; writers holds one Writer per lane
+    void TracePackets(size_t begin, size_t end, const Scene &scene, PathArena::Writer *writers, SimulationStats *stats, size_t thread_id) const;
+    // Stop tracing light_ray, LightRay i, handing its path to path_stream_ if set and giving its vertices back to writer if
+    // they are not kept
+    void Finish(LightRay &light_ray, size_t i, PathArena::Writer &writer, size_t thread_id) const;
 
 public:
     void AddDeflector(std::shared_ptr<Deflector> deflector)
     {
         deflectors_.push_back(deflector);
+        scene_.reset();
     }
     void AddLightRay(std::shared_ptr<LightRay> light_ray)
     {
         light_rays_.push_back(light_ray);
     }
-    void Simulation();
+    // Make room for deflectors more Deflectors and light_rays more LightRays, before adding many at once
+    void Reserve(size_t deflectors, size_t light_rays)
+    {
+        ReserveMore(deflectors_, deflectors);
+        ReserveMore(light_rays_, light_rays);
+    }
+    const std::vector<std::shared_ptr<LightRay>> &GetLightRays() const { return light_rays_; }
+    void SetIntersectionMode(IntersectionMode mode)
+    {
+        if (mode != intersection_mode_)
+            scene_.reset();
+        intersection_mode_ = mode;
+    }
+    IntersectionMode GetIntersectionMode() const { return intersection_mode_; }
+    // Number of threads tracing LightRays in parallel; 1 traces them serially on the calling thread, 0 uses every hardware thread.
+    // The traced paths do not depend on the thread count
+    void SetThreadCount(size_t thread_count)
+    {
+        if (thread_count != thread_count_)
+            pool_.reset();
+        thread_count_ = thread_count;
+    }
+    size_t GetThreadCount() const { return thread_count_; }
+    // Whether to find the nearest Deflectors of several LightRays at once with the SIMD packet kernel; the traced paths are the same
+    void SetPacketTracing(bool packet_tracing) { packet_tracing_ = packet_tracing; }
+    bool GetPacketTracing() const { return packet_tracing_; }
+    void SetSimulationOptions(const SimulationOptions &options) { options_ = options; }
+    const SimulationOptions &GetSimulationOptions() const { return options_; }
+    // Whether Simulation counts its work; the counters cost a few increments per intersection test
+    void SetCollectStats(bool collect_stats) { collect_stats_ = collect_stats; }
+    bool GetCollectStats() const { return collect_stats_; }
+    // The counters of the last Simulation run with SetCollectStats on
+    const SimulationStats &GetStats() const { return stats_; }
+    // Write each traced path to stream as soon as its LightRay stops, instead of keeping it: the LightRays then have empty
+    // paths after Simulation, which needs memory for the paths being traced only; nullptr keeps the paths
+    void SetPathStream(PathStream *stream) { path_stream_ = stream; }
+    PathStream *GetPathStream() const { return path_stream_; }
+    // Trace the rays of source after the LightRays, without a LightRay object per ray: their paths are only seen through a
+    // PathStream, where they follow the LightRays in numbering, and their work through the counters
+    void SetRaySource(std::shared_ptr<const RaySource> source) { ray_source_ = std::move(source); }
+    std::shared_ptr<const RaySource> GetRaySource() const { return ray_source_; }
+    // Trace every LightRay against the Deflectors; control, if not nullptr, orders the LightRays, can cancel the run and is told
+    // of each traced LightRay. Nothing else may touch the Field while it runs
+    void Simulation(SimulationControl *control = nullptr);
+    // The snapshot traced by the last Simulation, or nullptr if the Deflectors changed since
+    std::shared_ptr<const Scene> GetScene() const { return scene_; }
+    // Remove the LightRays only, keeping the Deflectors and their compiled Scene
+    void ClearLightRays() { light_rays_.clear(); }
+    // Whether retracing only the LightRays of order, with SimulationControl::keep_others, would leave arena_ holding more
+    // vertices of replaced paths than of live ones; a full Simulation reclaims them
+    bool ShouldRetraceAll(const std::vector<size_t> &order) const;
     void Clear()
     {
         light_rays_.clear();
         deflectors_.clear();
+        ray_source_.reset();
+        scene_.reset();
     }
 };
 
@@ -0,0 +1,75 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "geometry.h"
+#include "bvh.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+// Number of rays traced together in a RayPacket: 8 with AVX-512, 4 with AVX2 and with the scalar fallback
+#if defined(__AVX512F__)
+constexpr size_t kPacketWidth = 8;
+#else
+constexpr size_t kPacketWidth = 4;
+#endif
+
+// Segment index of a lane without a hit
+constexpr int64_t kNoSegment = std::numeric_limits<int64_t>::max();
+
+// Rays stored as structure of arrays, one ray per lane
+struct alignas(64) RayPacket
+{
+    double start_x[kPacketWidth];
+    double start_y[kPacketWidth];
+    double direction_x[kPacketWidth];
+    double direction_y[kPacketWidth];
+    int64_t excluded[kPacketWidth]; // Index of the segment the lane skips, or -1
+    bool active[kPacketWidth];      // Whether the lane holds a ray
+    void Set(size_t lane, const Ray &ray, int64_t excluded_segment)
+    {
+        active[lane] = true;
+        start_x[lane] = ray.GetStart().x;
+        start_y[lane] = ray.GetStart().y;
+        direction_x[lane] = ray.GetDirection().x;
+        direction_y[lane] = ray.GetDirection().y;
+        excluded[lane] = excluded_segment;
+    }
+    // Turn the lane off; a zero direction never intersects anything
+    void Disable(size_t lane)
+    {
+        active[lane] = false;
+        start_x[lane] = start_y[lane] = 0.0;
+        direction_x[lane] = direction_y[lane] = 0.0;
+        excluded[lane] = -1;
+    }
+};
+
+// Nearest segment hit by each lane of a RayPacket
+struct alignas(64) PacketHits
+{
+    double ray_parameter[kPacketWidth];     // Parameter of the hit on the ray, or +inf
+    double segment_parameter[kPacketWidth]; // Parameter of the hit on the segment
+    int64_t segment[kPacketWidth];          // Index of the hit segment, or kNoSegment
+    void Reset()
+    {
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+        {
+            ray_parameter[lane] = std::numeric_limits<double>::infinity();
+            segment_parameter[lane] = 0.0;
+            segment[lane] = kNoSegment;
+        }
+    }
+    bool Hit(size_t lane) const { return segment[lane] != kNoSegment; }
+};
+
+// Intersect every lane with segment seg of index i, keeping the nearest hit per lane; a hit is computed exactly as
+// GetLineIntersection(Ray, Segment) computes it, and ties go to the lower segment index
+void IntersectPacket(const RayPacket &packet, const Segment &seg, int64_t i, PacketHits &hits);
+
+// Find the nearest of the segments hit by each lane, traversing bvh if it is not nullptr and testing every segment otherwise;
+// unless tests is nullptr, tests[i] is increased by the number of active lanes each time segments[i] is tested
+void IntersectPacket(const RayPacket &packet, const std::vector<Segment> &segments, const SegmentBVH *bvh, PacketHits &hits, uint64_t *tests = nullptr);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef PATHSTREAM_H
+#define PATHSTREAM_H
+
+#include "optics.h"
+#include <ostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+enum class PathFormat
+{
+    // One line per LightRay: <index> <status> <energy> <vertex count> <x0> <y0> <x1> <y1> ...
+    Text,
+    // The header "OPTPATH" '\0' <uint32 version> <uint32 0>, then per LightRay <uint64 index> <uint32 RayStatus>
+    // <uint32 vertex count> <double energy> and the vertices as pairs of doubles, all in native byte order
+    Binary
+};
+
+// Output of the paths traced by Field::Simulation, written while the LightRays are traced instead of being kept in memory. Each
+// tracing thread fills a chunk of its own; full chunks are queued to a background thread that writes them, and a tracing thread
+// waits when the queue is full, which bounds the memory held by pending output. The LightRays are written in the order they stop,
+// which depends on the thread count, hence their index
+class PathStream
+{
+public:
+    // Bytes of output a thread gathers before handing them to the writing thread
+    static constexpr size_t kChunkSize = size_t(1) << 20;
+
+    // Stream to out, which must outlive the PathStream, with at most max_chunks full chunks waiting to be written
+    PathStream(std::ostream &out, PathFormat format, size_t max_chunks = 8);
+    ~PathStream();
+    PathStream(const PathStream &) = delete;
+    PathStream &operator=(const PathStream &) = delete;
+
+    // Used by Field::Simulation: give each of thread_count threads a chunk, write the LightRay of index light_ray_index from
+    // thread thread_id, and queue the partly filled chunks once every LightRay is traced
+    void BeginSimulation(size_t thread_count);
+    void Write(size_t thread_id, uint64_t light_ray_index, const LightRay &light_ray);
+    void EndSimulation();
+
+    // Wait until everything queued is written and stop the writing thread, returning whether out is still good
+    bool Close();
+    // Number of paths handed to the writing thread so far
+    uint64_t GetPathCount() const;
+
+private:
+    struct alignas(64) ThreadChunk
+    {
+        std::string data;
+        uint64_t paths = 0;
+    };
+
+    std::ostream *out_;
+    PathFormat format_;
+    size_t max_chunks_;
+    std::vector<ThreadChunk> chunks_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<std::string> queue_;  // Full chunks, in the order they are written
+    std::vector<std::string> spare_; // Written chunks, whose memory is reused
+    uint64_t paths_ = 0;
+    bool closing_ = false;
+    std::thread thread_;
+
+    // Queue chunk, replacing it with an empty chunk
+    void Submit(ThreadChunk &chunk);
+    // Loop of the writing thread
+    void Run();
+};
+
+#endif
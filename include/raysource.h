@@ -0,0 +1,57 @@
+#ifndef RAYSOURCE_H
+#define RAYSOURCE_H
+
+#include "geometry.h"
+#include "mappedfile.h"
+#include <string>
+#include <exception>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+// Ray file that cannot be opened or is malformed
+class RayFileException : public std::exception
+{
+private:
+    std::string message_;
+
+public:
+    RayFileException(std::string message) : message_(std::move(message)) {}
+    const char *what() const noexcept override { return message_.c_str(); }
+};
+
+// Light rays read from a packed binary ray file, which is memory-mapped rather than loaded, so that a Field can trace tens of
+// millions of rays without a LightRay object per ray. The file holds the header "OPTRAYS" '\0' <uint32 version 1>
+// <uint32 flags> <uint64 count>, then count records of doubles in native byte order: start_x, start_y, direction_x,
+// direction_y, then the wavelength if flags has kHasWavelength, then the weight if flags has kHasWeight. The weight is the
+// initial energy of the ray, 1 if absent; the wavelength is carried along for the tools that produce and consume ray files, as
+// the optical elements are not dispersive. Rays are not checked when the file is opened: a ray of zero or non-finite direction,
+// or of negative or non-finite weight, stops as RayStatus::Degenerate when traced
+class RaySource
+{
+public:
+    static constexpr uint32_t kHasWavelength = 1;
+    static constexpr uint32_t kHasWeight = 2;
+
+    // Map the ray file at path, throwing RayFileException if it cannot be read or its header does not match its size
+    explicit RaySource(const std::string &path);
+
+    size_t Size() const { return count_; }
+    uint32_t GetFlags() const { return flags_; }
+    Ray GetRay(size_t i) const
+    {
+        const double *record = records_ + i * stride_;
+        return Ray(Point{record[0], record[1]}, Vec{record[2], record[3]}, kUncheckedDirection);
+    }
+    double GetWavelength(size_t i) const { return (flags_ & kHasWavelength) != 0 ? records_[i * stride_ + 4] : 0.0; }
+    double GetWeight(size_t i) const { return (flags_ & kHasWeight) != 0 ? records_[i * stride_ + stride_ - 1] : 1.0; }
+
+private:
+    MappedFile file_;
+    const double *records_ = nullptr;
+    size_t count_ = 0;
+    size_t stride_ = 4; // Doubles per record
+    uint32_t flags_ = 0;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SEGMENTGRID_H
+#define SEGMENTGRID_H
+
+#include "geometry.h"
+#include <vector>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+
+// Uniform grid over a set of segments, each belonging to an owner such as the index of an optical element or light ray, used to
+// find the segments within a box and the segment nearest to a point without going through every segment
+class SegmentGrid
+{
+public:
+    struct Entry
+    {
+        Point start;
+        Point end;
+        uint32_t owner;
+    };
+
+    // Bounds of the number of cells: about one per segment, and at most kMaxCells in all or kMaxAxisCells along an axis
+    static constexpr size_t kMaxCells = size_t(1) << 20;
+    static constexpr size_t kMaxAxisCells = 4096;
+
+    // Rebuild the grid over entries; entries with an endpoint that is not finite are left out
+    void Build(std::vector<Entry> entries);
+    void Clear()
+    {
+        entries_.clear();
+        cell_start_.assign(1, 0);
+        cell_entries_.clear();
+        columns_ = rows_ = 0;
+        bounds_ = BoundingBox();
+    }
+    bool Empty() const { return entries_.empty(); }
+    // Bounding box of the entries
+    const BoundingBox &GetBounds() const { return bounds_; }
+
+    // Visit the entries whose bounding box overlaps box; an entry spanning several cells may be visited more than once
+    template <class Visitor>
+    void ForEachInBox(const BoundingBox &box, Visitor &&visit) const
+    {
+        if (entries_.empty() || box.Empty())
+            return;
+        size_t c0 = GetColumn(box.min.x), c1 = GetColumn(box.max.x);
+        size_t r0 = GetRow(box.min.y), r1 = GetRow(box.max.y);
+        for (size_t r = r0; r <= r1; r++)
+            for (size_t c = c0; c <= c1; c++)
+            {
+                size_t cell = r * columns_ + c;
+                for (uint32_t k = cell_start_[cell]; k < cell_start_[cell + 1]; k++)
+                {
+                    const Entry &entry = entries_[cell_entries_[k]];
+                    if (std::max(entry.start.x, entry.end.x) >= box.min.x && std::min(entry.start.x, entry.end.x) <= box.max.x &&
+                        std::max(entry.start.y, entry.end.y) >= box.min.y && std::min(entry.start.y, entry.end.y) <= box.max.y)
+                        visit(entry);
+                }
+            }
+    }
+
+    // The entry nearest to p among those within max_distance of it, if any
+    std::optional<Entry> FindNearest(const Point &p, double max_distance) const;
+
+private:
+    std::vector<Entry> entries_;
+    BoundingBox bounds_;
+    // The entries crossing cell i, row by row, are cell_entries_[cell_start_[i], cell_start_[i + 1])
+    std::vector<uint32_t> cell_start_{0};
+    std::vector<uint32_t> cell_entries_;
+    Point origin_{};
+    double inverse_cell_width_ = 0.0;
+    double inverse_cell_height_ = 0.0;
+    size_t columns_ = 0;
+    size_t rows_ = 0;
+
+    // Cell coordinates of a coordinate, clamped to the grid
+    size_t GetColumn(double x) const { return Quantize((x - origin_.x) * inverse_cell_width_, columns_); }
+    size_t GetRow(double y) const { return Quantize((y - origin_.y) * inverse_cell_height_, rows_); }
+    static size_t Quantize(double cell, size_t count)
+    {
+        if (!(cell > 0.0))
+            return 0;
+        return cell >= static_cast<double>(count - 1) ? count - 1 : static_cast<size_t>(cell);
+    }
+    // Call visit(cell) for each cell the segment crosses, going through the columns it spans and, in each, the rows it spans
+    template <class Visitor>
+    void ForEachCell(const Entry &entry, Visitor &&visit) const;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+// Thread pool with per-thread chunk queues; a thread whose queue runs empty steals chunks from the back of the other queues
+class ThreadPool
+{
+public:
+    // Task invoked on the index range [begin, end) by the thread with the given id
+    using Task = std::function<void(size_t begin, size_t end, size_t thread_id)>;
+
+    // Create a pool running tasks on num_threads threads, including the calling thread; 0 means one per hardware thread
+    explicit ThreadPool(size_t num_threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t GetThreadCount() const { return queues_.size(); }
+    // Run task over [0, n) split into chunks of at most chunk_size indices, and wait for all of them;
+    // the first exception thrown by the task is rethrown here after the remaining chunks are dropped
+    void ParallelFor(size_t n, size_t chunk_size, const Task &task);
+
+private:
+    struct Chunk
+    {
+        size_t begin;
+        size_t end;
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_; // queues_[0] belongs to the calling thread
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const Task *task_ = nullptr;
+    uint64_t generation_ = 0;
+    size_t busy_ = 0;
+    bool stop_ = false;
+    std::atomic<bool> failed_{false};
+    std::exception_ptr error_;
+
+    void WorkerLoop(size_t thread_id);
+    // Run chunks from the own queue, then steal from the others until every queue is empty
+    void RunChunks(size_t thread_id);
+    bool PopChunk(size_t thread_id, Chunk &chunk);
+};
+
+#endif
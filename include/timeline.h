@@ -0,0 +1,61 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+// Timeline of scoped events, kept in a ring buffer shared by all threads and exported in the Chrome trace-event format, which
+// chrome://tracing and Perfetto display; while not recording, a scope costs a single atomic load
+class Timeline
+{
+public:
+    // Number of events kept; the oldest events are overwritten first
+    static constexpr size_t kCapacity = size_t(1) << 16;
+
+    // Start recording, discarding the events recorded before
+    static void Start();
+    // Stop recording; the events stay available for export
+    static void Stop();
+    static bool IsRecording() { return recording_.load(std::memory_order_acquire); }
+    // Nanoseconds on the clock of the timeline
+    static uint64_t Now();
+    // Record an event of the calling thread; name and category must outlive the timeline, like string literals
+    static void Record(const char *name, const char *category, uint64_t begin_ns, uint64_t end_ns);
+    // Write the events recorded since Start as a Chrome trace-event JSON object; events still being recorded are left out
+    static void WriteChromeTrace(std::ostream &out);
+
+private:
+    static std::atomic<bool> recording_;
+};
+
+// Records the lifetime of a scope as an event of the Timeline, if the Timeline was recording when the scope was entered
+class TimelineScope
+{
+private:
+    const char *name_;
+    const char *category_;
+    uint64_t begin_ns_;
+    bool active_;
+
+public:
+    TimelineScope(const char *name, const char *category) : name_(name), category_(category), active_(Timeline::IsRecording())
+    {
+        begin_ns_ = active_ ? Timeline::Now() : 0;
+    }
+    ~TimelineScope()
+    {
+        if (active_)
+            Timeline::Record(name_, category_, begin_ns_, Timeline::Now());
+    }
+    TimelineScope(const TimelineScope &) = delete;
+    TimelineScope &operator=(const TimelineScope &) = delete;
+};
+
+#define TIMELINE_CONCAT_IMPL(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_IMPL(a, b)
+// Record the rest of the enclosing scope as an event of the Timeline
+#define TIMELINE_SCOPE(name, category) TimelineScope TIMELINE_CONCAT(timeline_scope_, __LINE__)(name, category)
+
+#endif
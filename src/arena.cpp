@@ -0,0 +1,27 @@
+#include "arena.h"
+#include <algorithm>
+
+void PathArena::Writer::Grow()
+{
+    size_t length = cursor_ - start_;
+    size_t capacity;
+    Point *data = arena_->Acquire(std::max(kBlockSize, 2 * (length + 1)), capacity);
+    std::copy(data_ + start_, data_ + cursor_, data);
+    data_ = data;
+    capacity_ = capacity;
+    start_ = 0;
+    cursor_ = length;
+}
+
+Point *PathArena::Acquire(size_t min_capacity, size_t &capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t k = used_;
+    while (k < blocks_.size() && blocks_[k].capacity < min_capacity)
+        k++;
+    if (k == blocks_.size())
+        blocks_.push_back({std::make_unique_for_overwrite<Point[]>(min_capacity), min_capacity});
+    std::swap(blocks_[k], blocks_[used_]);
+    capacity = blocks_[used_].capacity;
+    return blocks_[used_++].data.get();
+}
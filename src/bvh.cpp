@@ -0,0 +1,59 @@
+#include "bvh.h"
+#include <algorithm>
+
+void SegmentBVH::Build(const std::vector<Segment> &segments)
+{
+    Clear();
+    if (segments.empty())
+        return;
+    std::vector<BoundingBox> boxes;
+    std::vector<Point> centers;
+    boxes.reserve(segments.size());
+    centers.reserve(segments.size());
+    indices_.reserve(segments.size());
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        BoundingBox box = GetPaddedBoundingBox(segments[i]);
+        boxes.push_back(box);
+        centers.push_back(box.Center());
+        indices_.push_back(static_cast<uint32_t>(i));
+    }
+    nodes_.reserve(2 * segments.size() / kLeafSize + 1);
+    BuildNode(boxes, centers, 0, static_cast<uint32_t>(indices_.size()));
+}
+
+uint32_t SegmentBVH::BuildNode(const std::vector<BoundingBox> &boxes, const std::vector<Point> &centers, uint32_t begin, uint32_t end)
+{
+    uint32_t node_index = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(Node{});
+    BoundingBox box, center_box;
+    for (uint32_t k = begin; k < end; k++)
+    {
+        box.Expand(boxes[indices_[k]]);
+        center_box.Expand(centers[indices_[k]]);
+    }
+    nodes_[node_index].box = box;
+    if (end - begin <= kLeafSize)
+    {
+        nodes_[node_index].first = begin;
+        nodes_[node_index].count = end - begin;
+        return node_index;
+    }
+
+    // Median split along the longest axis of the centers
+    Vec extent = center_box.Extent();
+    bool split_x = extent.x >= extent.y;
+    uint32_t mid = begin + (end - begin) / 2;
+    std::nth_element(indices_.begin() + begin, indices_.begin() + mid, indices_.begin() + end,
+                     [&](uint32_t a, uint32_t b)
+                     {
+                         double ca = split_x ? centers[a].x : centers[a].y;
+                         double cb = split_x ? centers[b].x : centers[b].y;
+                         return ca < cb || (ca == cb && a < b);
+                     });
+    BuildNode(boxes, centers, begin, mid);
+    uint32_t right = BuildNode(boxes, centers, mid, end);
+    nodes_[node_index].first = right;
+    nodes_[node_index].count = 0;
+    return node_index;
+}
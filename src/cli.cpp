@@ -0,0 +1,259 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <limits>
+#include <stdexcept>
+#include <iterator>
+#include <variant>
+#include <optional>
+#include "optics.h"
+#include "luaapi.h"
+#include "layout.h"
+#include "layoutcache.h"
+#include "pathstream.h"
+#include "raysource.h"
+#include "timeline.h"
+
+// Headless entry point: runs a layout script, traces it and writes the paths of the light rays, one line per light ray:
+//     <status> <energy> <vertex count> <x0> <y0> <x1> <y1> ...
+// and optionally the counters of the simulation as JSON. With --stream, the paths are written while they are traced, in the
+// order the light rays stop, each line starting with the index of its light ray; see PathFormat
+
+static const char *kUsage =
+    "usage: optsim-cli [options] <layout.lua> <output>\n"
+    "  -t, --threads <n>       tracing threads, 0 for every hardware thread (default 0)\n"
+    "  --linear                test every element instead of traversing the hierarchy\n"
+    "  --packets               trace light rays in SIMD packets; faster for parallel bundles only, slower for scattered rays\n"
+    "  --max-bounces <n>       steps traced per light ray (default 1000)\n"
+    "  --min-energy <e>        stop light rays whose energy falls below e (default 0)\n"
+    "  --no-cycle-detection    trace light rays trapped in periodic orbits up to the step limit\n"
+    "  --rays <file>           trace the rays of a binary ray file too; requires --stream\n"
+    "  --stream <text|binary>  write the paths while tracing instead of keeping them in memory\n"
+    "  --stats <file>          write the counters of the simulation to file as JSON\n"
+    "  --no-cache              run the layout script even if its layout is cached\n"
+    "  --timeline <file>       write a Chrome trace of the script, simulation and output phases to file\n";
+
+static const char *GetDeflectorKind(const CompiledDeflector &deflector)
+{
+    static const char *const kKinds[] = {"mirror", "lens", "refractive", "wall", "custom"};
+    static_assert(std::size(kKinds) == std::variant_size_v<CompiledDeflector>);
+    return kKinds[deflector.index()];
+}
+
+// Write the counters of the simulation of scene as a JSON object
+static void WriteStats(std::ostream &out, const SimulationStats &stats, const Scene &scene)
+{
+    out << "{\n";
+    out << "  \"rays\": " << stats.rays << ",\n";
+    out << "  \"intersection_tests\": " << stats.intersection_tests << ",\n";
+    out << "  \"hits\": " << stats.hits << ",\n";
+    out << "  \"bounces\": " << stats.bounces << ",\n";
+    out << "  \"max_bounces\": " << stats.max_bounces << ",\n";
+    out << "  \"terminations\": {";
+    for (size_t k = 0; k < kRayStatusCount; k++)
+        out << (k == 0 ? "" : ", ") << '"' << GetRayStatusName(static_cast<RayStatus>(k)) << "\": " << stats.terminations[k];
+    out << "},\n";
+    out << "  \"bounce_histogram\": [";
+    for (size_t k = 0; k < stats.bounce_histogram.size(); k++)
+        out << (k == 0 ? "" : ", ") << stats.bounce_histogram[k];
+    out << "],\n";
+    out << "  \"deflectors\": [";
+    for (size_t i = 0; i < stats.deflector_tests.size(); i++)
+    {
+        const Segment &seg = scene.GetSegments()[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"index\": " << i << ", \"kind\": \"" << GetDeflectorKind(scene.GetDeflector(i))
+            << "\", \"start\": [" << seg.GetStart().x << ", " << seg.GetStart().y << "], \"end\": [" << seg.GetEnd().x << ", "
+            << seg.GetEnd().y << "], \"tests\": " << stats.deflector_tests[i] << ", \"hits\": " << stats.deflector_hits[i] << "}";
+    }
+    out << (stats.deflector_tests.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+}
+
+int main(int argc, char **argv)
+{
+    Field field;
+    SimulationOptions options;
+    size_t thread_count = 0;
+    bool use_cache = true;
+    std::optional<PathFormat> stream_format;
+    std::string layout_file, output_file, stats_file, timeline_file, rays_file;
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if ((arg == "-t" || arg == "--threads") && has_value)
+                thread_count = std::stoul(argv[++i]);
+            else if (arg == "--linear")
+                field.SetIntersectionMode(IntersectionMode::LinearScan);
+            else if (arg == "--packets")
+                field.SetPacketTracing(true);
+            else if (arg == "--max-bounces" && has_value)
+                options.max_bounces = std::stoul(argv[++i]);
+            else if (arg == "--min-energy" && has_value)
+                options.min_energy = std::stod(argv[++i]);
+            else if (arg == "--no-cycle-detection")
+                options.detect_cycles = false;
+            else if (arg == "--rays" && has_value)
+                rays_file = argv[++i];
+            else if (arg == "--stream" && has_value)
+            {
+                std::string format = argv[++i];
+                if (format != "text" && format != "binary")
+                    throw std::invalid_argument(format);
+                stream_format = format == "text" ? PathFormat::Text : PathFormat::Binary;
+            }
+            else if (arg == "--no-cache")
+                use_cache = false;
+            else if (arg == "--stats" && has_value)
+                stats_file = argv[++i];
+            else if (arg == "--timeline" && has_value)
+                timeline_file = argv[++i];
+            else if (arg.size() > 1 && arg[0] == '-')
+                throw std::invalid_argument(arg);
+            else if (layout_file.empty())
+                layout_file = arg;
+            else if (output_file.empty())
+                output_file = arg;
+            else
+                throw std::invalid_argument(arg);
+        }
+    }
+    catch (const std::logic_error &)
+    {
+        std::cerr << kUsage;
+        return 2;
+    }
+    if (layout_file.empty() || output_file.empty())
+    {
+        std::cerr << kUsage;
+        return 2;
+    }
+    if (!rays_file.empty() && !stream_format.has_value())
+    {
+        std::cerr << "optsim-cli: --rays requires --stream, as the paths of the rays of a ray file are not kept\n" << kUsage;
+        return 2;
+    }
+    field.SetThreadCount(thread_count);
+    field.SetSimulationOptions(options);
+    field.SetCollectStats(!stats_file.empty());
+    if (!timeline_file.empty())
+        Timeline::Start();
+
+    FieldBuilder builder(field);
+    LuaInterpreter interpreter;
+    LuaLayout::Register(interpreter);
+    LayoutCache cache(use_cache ? LayoutCache::GetDefaultDirectory() : std::filesystem::path());
+    try
+    {
+        TIMELINE_SCOPE("lua script", "script");
+        RunLayoutScript(interpreter, layout_file, builder, cache);
+    }
+    catch (const LuaExecutionException &e)
+    {
+        std::cerr << "optsim-cli: failed to run layout script " << layout_file << ": " << e.what() << "\n";
+        return 1;
+    }
+    catch (const ZeroDivisionException &)
+    {
+        std::cerr << "optsim-cli: layout script " << layout_file << " adds an element of zero length or a light ray of zero direction\n";
+        return 1;
+    }
+
+    if (!rays_file.empty())
+    {
+        try
+        {
+            field.SetRaySource(std::make_shared<const RaySource>(rays_file));
+        }
+        catch (const RayFileException &e)
+        {
+            std::cerr << "optsim-cli: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    // Only a stream opens the output before the simulation, so that otherwise a failed simulation leaves an existing file as it is
+    std::ofstream output;
+    auto open_output = [&]
+    {
+        output.open(output_file, stream_format == PathFormat::Binary ? std::ios::binary : std::ios::openmode());
+        if (!output)
+            std::cerr << "optsim-cli: cannot open " << output_file << "\n";
+        return static_cast<bool>(output);
+    };
+    std::optional<PathStream> stream;
+    if (stream_format.has_value())
+    {
+        if (!open_output())
+            return 1;
+        stream.emplace(output, *stream_format);
+        field.SetPathStream(&*stream);
+    }
+
+    try
+    {
+        field.Simulation();
+    }
+    catch (const InvalidDeflectorException &e)
+    {
+        std::cerr << "optsim-cli: invalid optical element #" << e.GetIndex() + 1 << ": " << e.what() << "\n";
+        return 1;
+    }
+
+    if (stream.has_value())
+    {
+        TIMELINE_SCOPE("flush path stream", "output");
+        stream->Close();
+        output.close();
+    }
+    else
+    {
+        if (!open_output())
+            return 1;
+        TIMELINE_SCOPE("write paths", "output");
+        output.precision(std::numeric_limits<double>::max_digits10);
+        for (const auto &light_ray : field.GetLightRays())
+        {
+            const PathView &path = light_ray->GetPath();
+            output << GetRayStatusName(light_ray->GetStatus()) << ' ' << light_ray->GetEnergy() << ' ' << path.Size();
+            for (const Point &p : path)
+                output << ' ' << p.x << ' ' << p.y;
+            output << '\n';
+        }
+        output.close();
+    }
+    if (!output)
+    {
+        std::cerr << "optsim-cli: failed to write " << output_file << "\n";
+        return 1;
+    }
+
+    if (!stats_file.empty())
+    {
+        std::ofstream stats_output(stats_file);
+        stats_output.precision(std::numeric_limits<double>::max_digits10);
+        WriteStats(stats_output, field.GetStats(), *field.GetScene());
+        stats_output.close();
+        if (!stats_output)
+        {
+            std::cerr << "optsim-cli: failed to write " << stats_file << "\n";
+            return 1;
+        }
+    }
+
+    if (!timeline_file.empty())
+    {
+        Timeline::Stop();
+        std::ofstream timeline_output(timeline_file);
+        Timeline::WriteChromeTrace(timeline_output);
+        timeline_output.close();
+        if (!timeline_output)
+        {
+            std::cerr << "optsim-cli: failed to write " << timeline_file << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "filewatcher.h"
+#include <filesystem>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FileWatcher::FileWatcher() : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+
+FileWatcher::~FileWatcher()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool FileWatcher::Watch(const std::string &path)
+{
+    if (fd_ < 0)
+        return false;
+    if (watch_ >= 0)
+        inotify_rm_watch(fd_, watch_);
+    std::filesystem::path file = std::filesystem::absolute(path);
+    name_ = file.filename().string();
+    watch_ = inotify_add_watch(fd_, file.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    return watch_ >= 0;
+}
+
+bool FileWatcher::ReadChanges()
+{
+    bool changed = false;
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd_, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t offset = 0; offset < length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+            // Events of a watch removed since are still queued, as is IN_IGNORED for the removal itself
+            if (event->wd == watch_ && event->len > 0 && name_ == event->name)
+                changed = true;
+            offset += sizeof(inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
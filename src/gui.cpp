@@ -2,42 +2,563 @@
 #include "utils.h"
 #include <sstream>
 #include <iomanip>
-
-OpticsBox *LuaUI::box_ = nullptr;
-Field *LuaUI::field_ = nullptr;
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <iterator>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
 
 OpticsBox::OpticsBox(int x, int y, int w, int h, const char *label)
-    : Fl_Widget(x, y, w, h, label), axis_(Point(x + w / 2, y + h / 2), w / 10.0)
+    : Fl_Widget(x, y, w, h, label), cache_(LayoutCache::GetDefaultDirectory()), axis_(Point(x + w / 2, y + h / 2), w / 10.0)
 {
-    LuaUI::Bind(this, &field_);
-    interpreter_.RegisterLuaFunction<LuaUI::AddMirrorFunctor>("add_mirror");
-    interpreter_.RegisterLuaFunction<LuaUI::AddLensFunctor>("add_lens");
-    interpreter_.RegisterLuaFunction<LuaUI::AddRefractiveFunctor>("add_refractive");
-    interpreter_.RegisterLuaFunction<LuaUI::AddLightRayFunctor>("add_lightray");
+    LuaLayout::Bind(this);
+    field_.SetThreadCount(0);
+    LuaLayout::Register(interpreter_);
+    if (watcher_.GetFd() >= 0)
+        Fl::add_fd(watcher_.GetFd(), FL_READ, OnScriptEvent, this);
     RunLuaScript();
-    RunSimulation();
     redraw();
 }
 
-OpticsBox::~OpticsBox() { LuaUI::UnBind(); }
+OpticsBox::~OpticsBox()
+{
+    CancelSimulation();
+    if (watcher_.GetFd() >= 0)
+        Fl::remove_fd(watcher_.GetFd());
+    Fl::remove_timeout(OnScriptSaved, this);
+    DeleteLayers();
+    LuaLayout::UnBind();
+}
+
+void OpticsBox::DeleteLayers()
+{
+    if (element_layer_ != 0)
+        fl_delete_offscreen(element_layer_);
+    if (ray_layer_ != 0)
+        fl_delete_offscreen(ray_layer_);
+    element_layer_ = 0;
+    ray_layer_ = 0;
+}
+
+void OpticsBox::draw()
+{
+    TIMELINE_SCOPE("draw", "gui");
+    bool draw_elements = (damage() & kDamageElements) != 0;
+    bool draw_rays = (damage() & kDamageRays) != 0;
+    if (element_layer_ == 0 || layer_w_ != w() || layer_h_ != h())
+    {
+        DeleteLayers();
+        layer_w_ = w();
+        layer_h_ = h();
+        element_layer_ = fl_create_offscreen(layer_w_, layer_h_);
+        ray_layer_ = fl_create_offscreen(layer_w_, layer_h_);
+        draw_elements = true;
+    }
+    Axis layer_axis = axis_;
+    layer_axis.Move(-x(), -y());
+    if (draw_elements)
+    {
+        TIMELINE_SCOPE("rasterize elements", "gui");
+        fl_begin_offscreen(element_layer_);
+        draw_box(FL_BORDER_BOX, 0, 0, layer_w_, layer_h_, FL_LIGHT3);
+        DrawElements(layer_axis, false, layer_w_, layer_h_);
+        fl_end_offscreen();
+    }
+    if (draw_elements || draw_rays)
+    {
+        TIMELINE_SCOPE("rasterize rays", "gui");
+        fl_begin_offscreen(ray_layer_);
+        fl_copy_offscreen(0, 0, layer_w_, layer_h_, element_layer_, 0, 0);
+        DrawElements(layer_axis, true, layer_w_, layer_h_);
+        fl_end_offscreen();
+    }
+    else if (!fresh_.empty())
+    {
+        // Only the LightRays shown since are added over the rays already drawn
+        TIMELINE_SCOPE("rasterize new rays", "gui");
+        fl_begin_offscreen(ray_layer_);
+        DrawIndexed(layer_axis, fresh_);
+        fl_end_offscreen();
+    }
+    fresh_.clear();
+    // Anything else, such as an expose or a change of highlight, only needs the cached layers
+    fl_copy_offscreen(x(), y(), w(), h(), ray_layer_, 0, 0);
+    fl_push_clip(x(), y(), w(), h());
+    if (hovered_.has_value())
+        DrawHighlight(*hovered_, FL_RED);
+    if (selected_.has_value())
+        DrawHighlight(*selected_, FL_MAGENTA);
+    fl_pop_clip();
+}
+
+namespace
+{
+    // LayoutRecords compared bit for bit
+    struct RecordHash
+    {
+        size_t operator()(const LayoutRecord &record) const
+        {
+            // 64-bit FNV-1a
+            uint64_t hash = 0xcbf29ce484222325ull;
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&record);
+            for (size_t i = 0; i < sizeof(record); i++)
+            {
+                hash ^= bytes[i];
+                hash *= 0x100000001b3ull;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    struct RecordEqual
+    {
+        bool operator()(const LayoutRecord &a, const LayoutRecord &b) const { return std::memcmp(&a, &b, sizeof(LayoutRecord)) == 0; }
+    };
+
+    bool IsLightRay(const LayoutRecord &record) { return record.kind == LayoutRecord::LightRayRecord; }
+
+    // Whether the part [0, t_max] of the line from start along direction crosses segment, with some slack for the rounding of
+    // the hit points computed on segment
+    bool Crosses(const Point &start, const Vec &direction, double t_max, const Segment &segment)
+    {
+        constexpr double kSlack = 1e-9;
+        Intersection intersection = GetLineIntersection(Line(start, direction, kUncheckedDirection), Line(segment.GetStart(), segment.GetDirection(), kUncheckedDirection));
+        return intersection.num_intersects == Intersection::OneIntersection && intersection.parameter1 >= -kSlack &&
+               intersection.parameter1 <= t_max + kSlack && intersection.parameter2 >= -kSlack && intersection.parameter2 <= 1.0 + kSlack;
+    }
+
+    // Whether the traced path of light_ray, or the ray it escaped along, crosses one of segments, so that tracing it again
+    // could give another path
+    bool Crosses(const LightRayElement &light_ray, const std::vector<Segment> &segments)
+    {
+        const PathView &path = light_ray.GetPath();
+        for (const Segment &segment : segments)
+        {
+            for (size_t k = 1; k < path.Size(); k++)
+                if (Crosses(path[k - 1], path[k] - path[k - 1], 1.0, segment))
+                    return true;
+            if (light_ray.GetStatus() == RayStatus::Escaped &&
+                Crosses(light_ray.GetRay().GetStart(), light_ray.GetRay().GetDirection(), std::numeric_limits<double>::infinity(), segment))
+                return true;
+        }
+        return false;
+    }
+}
 
-void MirrorElement::Draw(const Axis &axis) const
+void OpticsBox::LoadScript(const std::string &file)
 {
-    Point end = mirror_.seg_.GetEnd();
-    Point start = mirror_.seg_.GetStart();
-    Point w_end = axis.ToWindowCoord(end);
-    Point w_start = axis.ToWindowCoord(start);
-    fl_color(FL_BLUE);
-    fl_line(w_start.x, w_start.y, w_end.x, w_end.y);
+    // Watched even if it fails, so that saving it fixed loads it
+    if (file != script_file_)
+    {
+        script_file_ = file;
+        watcher_.Watch(file);
+    }
+    LayoutRecorder recorder;
+    try
+    {
+        TIMELINE_SCOPE("lua script", "script");
+        RunLayoutScript(interpreter_, file, recorder, cache_);
+    }
+    catch (const LuaExecutionException &e)
+    {
+        fl_alert("%s\nPlease check your Lua script!", e.what());
+        return;
+    }
+    catch (const ZeroDivisionException &)
+    {
+        fl_alert("Please check your Lua script!");
+        return;
+    }
+    ApplyLayout(recorder.GetRecords());
 }
 
-void LensElement::Draw(const Axis &axis) const
+void OpticsBox::ApplyLayout(const std::vector<LayoutRecord> &records)
 {
+    TIMELINE_SCOPE("apply layout", "gui");
+    // Elements added other than by a layout have no record to compare, so nothing is kept then
+    if (records_.size() != elements_.size())
+        Clear();
+    CancelSimulation();
+    // The Deflectors are kept if the layout adds the same ones in the same order; otherwise those it adds or removes are
+    // changed, and the LightRays whose paths cross them are traced again
+    std::vector<LayoutRecord> old_deflectors, new_deflectors;
+    std::copy_if(records_.begin(), records_.end(), std::back_inserter(old_deflectors), [](const LayoutRecord &r) { return !IsLightRay(r); });
+    std::copy_if(records.begin(), records.end(), std::back_inserter(new_deflectors), [](const LayoutRecord &r) { return !IsLightRay(r); });
+    bool same_deflectors = std::equal(old_deflectors.begin(), old_deflectors.end(), new_deflectors.begin(), new_deflectors.end(), RecordEqual());
+    std::vector<Segment> changed;
+    if (!same_deflectors)
+    {
+        std::unordered_map<LayoutRecord, ptrdiff_t, RecordHash, RecordEqual> balance;
+        for (const LayoutRecord &record : old_deflectors)
+            balance[record]--;
+        for (const LayoutRecord &record : new_deflectors)
+            balance[record]++;
+        for (const auto &[record, count] : balance)
+            if (count != 0)
+                changed.push_back(Segment(Point(record.values[0], record.values[1]), Vec(record.values[2], record.values[3])));
+    }
+
+    // The Elements of the current layout that the new one can keep
+    std::vector<std::shared_ptr<Element>> kept_deflectors;
+    std::unordered_multimap<LayoutRecord, std::shared_ptr<LightRayElement>, RecordHash, RecordEqual> kept_light_rays;
+    for (size_t k = 0; k < records_.size(); k++)
+        if (!IsLightRay(records_[k]))
+            kept_deflectors.push_back(elements_[k]);
+        else
+        {
+            auto light_ray = std::static_pointer_cast<LightRayElement>(elements_[k]);
+            if (light_ray->IsShown() && !Crosses(*light_ray, changed))
+                kept_light_rays.emplace(records_[k], light_ray);
+        }
+
+    elements_.clear();
+    light_ray_elements_.clear();
+    if (same_deflectors)
+        field_.ClearLightRays();
+    else
+        field_.Clear();
+    size_t light_ray_count = std::count_if(records.begin(), records.end(), IsLightRay);
+    Reserve(records.size() - light_ray_count, light_ray_count);
+    std::vector<size_t> traced;
+    size_t next_deflector = 0;
+    for (const LayoutRecord &record : records)
+    {
+        if (!IsLightRay(record) && same_deflectors)
+        {
+            AddElement(kept_deflectors[next_deflector++]);
+            continue;
+        }
+        auto kept = IsLightRay(record) ? kept_light_rays.find(record) : kept_light_rays.end();
+        if (kept == kept_light_rays.end())
+        {
+            if (IsLightRay(record))
+                traced.push_back(field_.GetLightRays().size());
+            ReplayLayout(&record, 1, *this);
+            continue;
+        }
+        light_ray_elements_.push_back(elements_.size());
+        field_.AddLightRay(kept->second);
+        AddElement(kept->second);
+        kept_light_rays.erase(kept);
+    }
+    records_ = records;
+    damage(kDamageElements);
+    // Tracing every LightRay again releases the paths kept from the earlier simulations, which is also done once the paths
+    // replaced by partial runs outweigh the live ones, so that saving edits again and again does not grow memory
+    if (traced.size() == field_.GetLightRays().size() || field_.ShouldRetraceAll(traced))
+        RunSimulation();
+    else
+        RunSimulation(std::move(traced));
+}
+
+void OpticsBox::OnScriptEvent(int, void *data)
+{
+    OpticsBox *box = static_cast<OpticsBox *>(data);
+    // Editors often write a file in several steps; reload once they are done
+    if (box->watcher_.ReadChanges())
+    {
+        Fl::remove_timeout(OnScriptSaved, box);
+        Fl::add_timeout(kReloadDelay, OnScriptSaved, box);
+    }
+}
+
+void OpticsBox::OnScriptSaved(void *data)
+{
+    OpticsBox *box = static_cast<OpticsBox *>(data);
+    TIMELINE_SCOPE("reload", "gui");
+    box->LoadScript(box->script_file_);
+}
+
+void OpticsBox::RunSimulation(std::optional<std::vector<size_t>> light_rays)
+{
+    CancelSimulation();
+    generation_++;
+    grid_.Clear();
+    indexed_elements_ = 0;
+    hovered_.reset();
+    selected_.reset();
+    fresh_.clear();
+
+    // The LightRays starting within the view first, the others in their own order
+    control_ = std::make_unique<SimulationControl>();
+    if (light_rays.has_value())
+    {
+        control_->order = std::move(*light_rays);
+        control_->keep_others = true;
+    }
+    else
+    {
+        control_->order.resize(field_.GetLightRays().size());
+        std::iota(control_->order.begin(), control_->order.end(), size_t(0));
+    }
+    for (size_t i : control_->order)
+        static_cast<LightRayElement &>(*elements_[light_ray_elements_[i]]).SetShown(false);
+    damage(kDamageRays);
+    const auto &all_light_rays = field_.GetLightRays();
+    BoundingBox view = GetView();
+    auto in_view = std::stable_partition(control_->order.begin(), control_->order.end(), [&](size_t i)
+    {
+        Point start = all_light_rays[i]->GetInitialRay().GetStart();
+        return start.x >= view.min.x && start.x <= view.max.x && start.y >= view.min.y && start.y <= view.max.y;
+    });
+    control_->priority_count = static_cast<size_t>(in_view - control_->order.begin());
+    control_->on_finish = [this](size_t i)
+    {
+        {
+            std::lock_guard<std::mutex> lock(published_mutex_);
+            published_.push_back(i);
+        }
+        Wake();
+    };
+    simulation_thread_ = std::thread([this, control = control_.get()]
+    {
+        std::exception_ptr error;
+        try
+        {
+            TIMELINE_SCOPE("run simulation", "gui");
+            field_.Simulation(control);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(published_mutex_);
+            simulation_done_ = true;
+            simulation_error_ = error;
+        }
+        Wake();
+    });
+}
+
+void OpticsBox::CancelSimulation()
+{
+    if (!simulation_thread_.joinable())
+        return;
+    control_->cancel = true;
+    simulation_thread_.join();
+    control_.reset();
+    std::lock_guard<std::mutex> lock(published_mutex_);
+    published_.clear();
+    simulation_done_ = false;
+    simulation_error_ = nullptr;
+}
+
+void OpticsBox::Wake()
+{
+    if (!awake_pending_.exchange(true))
+        Fl::awake(OnAwake, this);
+}
+
+void OpticsBox::OnAwake(void *data)
+{
+    static_cast<OpticsBox *>(data)->CollectPublished();
+}
+
+void OpticsBox::CollectPublished()
+{
+    // Cleared first, so that what is published from now on wakes the FLTK thread again
+    awake_pending_ = false;
+    std::vector<size_t> published;
+    bool done;
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(published_mutex_);
+        published.swap(published_);
+        done = simulation_done_;
+        error = simulation_error_;
+    }
+    for (size_t i : published)
+    {
+        size_t index = light_ray_elements_[i];
+        static_cast<LightRayElement &>(*elements_[index]).SetShown(true);
+        fresh_.push_back(index);
+    }
+    if (!published.empty())
+        redraw();
+    if (!done)
+        return;
+    CancelSimulation();
+    // Draw the rays again as a whole, in their own order, and index them for picking
+    BuildIndex();
+    damage(kDamageRays);
+    if (error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const InvalidDeflectorException &e)
+        {
+            fl_alert("Invalid optical element #%zu: %s! Please check your Lua script!", e.GetIndex() + 1, e.what());
+        }
+        catch (const std::exception &e)
+        {
+            fl_alert("Simulation failed: %s", e.what());
+        }
+    }
+}
+
+BoundingBox OpticsBox::GetView() const
+{
+    BoundingBox view;
+    view.Expand(axis_.ToFieldCoord(Point(x(), y())));
+    view.Expand(axis_.ToFieldCoord(Point(x() + w(), y() + h())));
+    return view;
+}
+
+void OpticsBox::BuildIndex()
+{
+    TIMELINE_SCOPE("build index", "gui");
+    std::vector<SegmentGrid::Entry> segments;
+    for (size_t i = 0; i < elements_.size(); i++)
+        elements_[i]->GetSegments(static_cast<uint32_t>(i), segments);
+    grid_.Build(std::move(segments));
+    indexed_elements_ = elements_.size();
+    indexed_.assign(indexed_elements_, false);
+}
+
+void OpticsBox::DrawHighlight(size_t index, Fl_Color color) const
+{
+    if (index >= elements_.size())
+        return;
+    std::vector<SegmentGrid::Entry> segments;
+    elements_[index]->GetSegments(0, segments);
+    fl_color(color);
+    fl_line_style(FL_SOLID, 3);
+    axis_.PushTransform();
+    for (const SegmentGrid::Entry &segment : segments)
+    {
+        fl_begin_line();
+        fl_vertex(segment.start.x, segment.start.y);
+        fl_vertex(segment.end.x, segment.end.y);
+        fl_end_line();
+    }
+    fl_pop_matrix();
+    fl_line_style(0);
+}
+
+std::optional<size_t> OpticsBox::Pick(int x, int y) const
+{
+    std::optional<SegmentGrid::Entry> nearest = grid_.FindNearest(axis_.ToFieldCoord(Point(x, y)), kPickRadius / axis_.GetScale());
+    if (!nearest.has_value())
+        return std::nullopt;
+    return nearest->owner;
+}
+
+void StripRenderer::MoveTo(const Point &p)
+{
+    Flush();
+    fl_begin_line();
+    fl_vertex(p.x, p.y);
+    open_ = true;
+    last_drawn_ = p;
+    last_ = p;
+}
+
+void StripRenderer::LineTo(const Point &p)
+{
+    last_ = p;
+    pending_ = (p - last_drawn_).NormSquare() < tolerance_square_;
+    if (!pending_)
+    {
+        fl_vertex(p.x, p.y);
+        last_drawn_ = p;
+    }
+}
+
+void StripRenderer::Flush()
+{
+    if (!open_)
+        return;
+    if (pending_)
+        fl_vertex(last_.x, last_.y);
+    fl_end_line();
+    open_ = false;
+    pending_ = false;
+}
+
+DrawContext::DrawContext(const Axis &axis, uint64_t generation)
+    : axis(axis),
+      zoom_bucket(static_cast<int>(std::floor(std::log2(axis.GetScale()) * kBucketsPerOctave))),
+      tolerance(0.5 / std::exp2(zoom_bucket / kBucketsPerOctave)),
+      generation(generation),
+      strips(tolerance)
+{
+}
+
+void OpticsBox::DrawElements(const Axis &axis, bool traced, int w, int h) const
+{
+    // The indexed Elements with a segment within the layer, padded by the size of the arrow heads of lenses; every one of them
+    // when the layer covers the whole grid, as when zoomed out, where querying the grid would cost more than it saves
+    std::vector<size_t> indices;
+    if (indexed_elements_ > 0)
+    {
+        BoundingBox view;
+        view.Expand(axis.ToFieldCoord(Point(0, 0)));
+        view.Expand(axis.ToFieldCoord(Point(w, h)));
+        view.Pad(12.0 / axis.GetScale());
+        if (view.Contains(grid_.GetBounds()))
+        {
+            indices.resize(indexed_elements_);
+            std::iota(indices.begin(), indices.end(), size_t(0));
+        }
+        else
+        {
+            // An Element crossing several cells is visited once per cell; indexed_ marks those already taken, and is
+            // cleared again before returning
+            grid_.ForEachInBox(view, [&](const SegmentGrid::Entry &entry)
+                               {
+                                   if (!indexed_[entry.owner])
+                                   {
+                                       indexed_[entry.owner] = true;
+                                       indices.push_back(entry.owner);
+                                   } });
+            for (size_t i : indices)
+                indexed_[i] = false;
+        }
+    }
+    for (size_t i = indexed_elements_; i < elements_.size(); i++)
+        indices.push_back(i);
+    std::erase_if(indices, [&](size_t i) { return elements_[i]->IsTraced() != traced; });
+    DrawIndexed(axis, indices);
+}
+
+void OpticsBox::DrawIndexed(const Axis &axis, const std::vector<size_t> &indices) const
+{
+    std::vector<Fl_Color> colors;
+    for (size_t i : indices)
+        if (std::find(colors.begin(), colors.end(), elements_[i]->GetColor()) == colors.end())
+            colors.push_back(elements_[i]->GetColor());
+    DrawContext context(axis, generation_);
+    axis.PushTransform();
+    for (Fl_Color color : colors)
+    {
+        fl_color(color);
+        for (size_t i : indices)
+            if (elements_[i]->GetColor() == color)
+                elements_[i]->Draw(context);
+        context.strips.Flush();
+    }
+    fl_pop_matrix();
+}
+
+void MirrorElement::Draw(DrawContext &context) const
+{
+    context.strips.AddSegment(mirror_.seg_.GetStart(), mirror_.seg_.GetEnd());
+}
+
+void LensElement::Draw(DrawContext &context) const
+{
+    // The arrow heads keep their size in pixels, so the lens is drawn in window coordinates, which the transform leaves alone
+    context.strips.Flush();
     Point end = lens_.seg_.GetEnd();
     Point start = lens_.seg_.GetStart();
-    Point w_end = axis.ToWindowCoord(end);
-    Point w_start = axis.ToWindowCoord(start);
-    fl_color(FL_BLACK);
+    Point w_end = context.axis.ToWindowCoord(end);
+    Point w_start = context.axis.ToWindowCoord(start);
     DrawArrow(w_start.x, w_start.y, w_end.x, w_end.y);
 
     // std::stringstream ss;
@@ -47,14 +568,10 @@ void LensElement::Draw(const Axis &axis) const
     // fl_draw(ss.str().c_str(), w_end.x + 4, w_end.y + 4);
 }
 
-void RefractiveElement::Draw(const Axis &axis) const
+void RefractiveElement::Draw(DrawContext &context) const
 {
-    Point end = refractive_.seg_.GetEnd();
-    Point start = refractive_.seg_.GetStart();
-    Point w_end = axis.ToWindowCoord(end);
-    Point w_start = axis.ToWindowCoord(start);
-    fl_color(FL_GREEN);
-    fl_line(w_start.x, w_start.y, w_end.x, w_end.y);
+    // Consecutive surfaces of a tessellated face join into one strip
+    context.strips.AddSegment(refractive_.seg_.GetStart(), refractive_.seg_.GetEnd());
 
     // std::stringstream ss;
     // ss << "nl,nr=" << std::setprecision(2) << refractive_.n_left_ << "," << refractive_.n_right_;
@@ -63,63 +580,135 @@ void RefractiveElement::Draw(const Axis &axis) const
     // fl_draw(ss.str().c_str(), w_end.x + 4, w_end.y + 4);
 }
 
-void LightRayElement::Draw(const Axis &axis) const
+void LightRayElement::UpdateDetail(const DrawContext &context) const
 {
-    for (auto seg : path_)
+    if (detail_.valid && detail_.zoom_bucket == context.zoom_bucket && detail_.generation == context.generation)
+        return;
+    detail_.zoom_bucket = context.zoom_bucket;
+    detail_.generation = context.generation;
+    detail_.valid = true;
+    std::vector<Point> &vertices = detail_.vertices;
+    vertices.clear();
+    double tolerance_square = context.tolerance * context.tolerance;
+    // Keep a vertex once it is at least the tolerance away from the last one kept, and the last vertex of each strip
+    auto add = [&](const Point &p, bool last)
+    {
+        if (vertices.size() == detail_.split || last || (p - vertices.back()).NormSquare() >= tolerance_square)
+            vertices.push_back(p);
+    };
+    // The path and the final ray as one strip, unless the final ray does not start at the end of the path
+    Point start = ray_.GetStart();
+    Point end = start + ray_.GetDirection().Normalize().Scale(kTailLength);
+    detail_.split = 0;
+    for (const Point &p : path_)
+        add(p, false);
+    if (path_.Size() == 0 || !(path_[path_.Size() - 1] == start))
+    {
+        if (path_.Size() > 0)
+        {
+            // Keep the end of the path, which the strip must reach
+            if (!(vertices.back() == path_[path_.Size() - 1]))
+                vertices.push_back(path_[path_.Size() - 1]);
+            detail_.split = vertices.size();
+        }
+        add(start, false);
+    }
+    add(end, true);
+
+    // Hash the pixel-sized cells the vertices fall in, so that rays drawn over the same pixels get the same footprint
+    double cell = 2.0 * context.tolerance;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](int64_t value)
     {
-        Point end = seg.GetEnd();
-        Point start = seg.GetStart();
-        Point w_end = axis.ToWindowCoord(end);
-        Point w_start = axis.ToWindowCoord(start);
-        fl_color(FL_DARK_YELLOW);
-        fl_line(w_start.x, w_start.y, w_end.x, w_end.y);
+        hash ^= static_cast<uint64_t>(value);
+        hash *= 0x100000001b3ull;
+    };
+    int64_t last_x = INT64_MIN, last_y = INT64_MIN;
+    for (size_t k = 0; k < vertices.size(); k++)
+    {
+        if (k == detail_.split && k > 0)
+            mix(INT64_MIN);
+        int64_t x = static_cast<int64_t>(std::floor(vertices[k].x / cell));
+        int64_t y = static_cast<int64_t>(std::floor(vertices[k].y / cell));
+        if (x != last_x || y != last_y || k == detail_.split)
+        {
+            mix(x);
+            mix(y);
+        }
+        last_x = x;
+        last_y = y;
     }
+    detail_.footprint = hash;
+}
+
+void LightRayElement::GetSegments(uint32_t owner, std::vector<SegmentGrid::Entry> &segments) const
+{
+    for (size_t k = 1; k < path_.Size(); k++)
+        segments.push_back({path_[k - 1], path_[k], owner});
     Point start = ray_.GetStart();
-    Point end = start + ray_.GetDirection().Normalize().Scale(20);
-    Point w_end = axis.ToWindowCoord(end);
-    Point w_start = axis.ToWindowCoord(start);
-    fl_color(FL_DARK_YELLOW);
-    fl_line(w_start.x, w_start.y, w_end.x, w_end.y);
+    segments.push_back({start, start + ray_.GetDirection().Normalize().Scale(kTailLength), owner});
+}
+
+void LightRayElement::Draw(DrawContext &context) const
+{
+    if (!shown_)
+        return;
+    UpdateDetail(context);
+    // A ray over the same pixels as one already drawn adds nothing
+    if (!context.footprints.insert(detail_.footprint).second)
+        return;
+    const std::vector<Point> &vertices = detail_.vertices;
+    for (size_t k = 0; k < vertices.size(); k++)
+        if (k == 0 || k == detail_.split)
+            context.strips.MoveTo(vertices[k]);
+        else
+            context.strips.LineTo(vertices[k]);
+    context.strips.Flush();
 }
 
-void LuaUI::AddMirrorFunctor::operator()(std::vector<double> ds) const
+void OpticsBox::AddMirror(const Mirror &mirror)
 {
-    if (ds.size() != 4 || LuaUI::field_ == nullptr || LuaUI::box_ == nullptr)
-        throw LuaExecutionException();
-    Mirror mirror(Segment(Point(ds[0], ds[1]), Point(ds[2] - ds[0], ds[3] - ds[1])));
     auto pmirror = std::make_shared<MirrorElement>(mirror);
-    LuaUI::field_->AddDeflector(pmirror);
-    LuaUI::box_->AddElement(pmirror);
+    field_.AddDeflector(pmirror);
+    AddElement(pmirror);
 }
 
-void LuaUI::AddLensFunctor::operator()(std::vector<double> ds) const
+void OpticsBox::AddLens(const Lens &lens)
 {
-    if (ds.size() != 5 || LuaUI::field_ == nullptr || LuaUI::box_ == nullptr)
-        throw LuaExecutionException();
-    Lens lens(Segment(Point(ds[0], ds[1]), Point(ds[2] - ds[0], ds[3] - ds[1])), ds[4]);
     auto plens = std::make_shared<LensElement>(lens);
-    LuaUI::field_->AddDeflector(plens);
-    LuaUI::box_->AddElement(plens);
+    field_.AddDeflector(plens);
+    AddElement(plens);
 }
 
-void LuaUI::AddRefractiveFunctor::operator()(std::vector<double> ds) const
+void OpticsBox::AddRefractive(const RefractiveSurface &refractive)
 {
-    if (ds.size() != 6 || LuaUI::field_ == nullptr || LuaUI::box_ == nullptr)
-        throw LuaExecutionException();
-    RefractiveSurface ref(Segment(Point(ds[0], ds[1]), Point(ds[2] - ds[0], ds[3] - ds[1])), ds[4], ds[5]);
-    auto pref = std::make_shared<RefractiveElement>(ref);
-    LuaUI::field_->AddDeflector(pref);
-    LuaUI::box_->AddElement(pref);
+    auto pref = std::make_shared<RefractiveElement>(refractive);
+    field_.AddDeflector(pref);
+    AddElement(pref);
 }
 
-void LuaUI::AddLightRayFunctor::operator()(std::vector<double> ds) const
+void OpticsBox::AddLightRay(const Ray &ray)
 {
-    if (ds.size() != 4 || LuaUI::field_ == nullptr || LuaUI::box_ == nullptr)
-        throw LuaExecutionException();
-    Ray ray(Point(ds[0], ds[1]), Point(ds[2], ds[3]));
     auto pray = std::make_shared<LightRayElement>(ray);
-    LuaUI::field_->AddLightRay(pray);
-    LuaUI::box_->AddElement(pray);
+    light_ray_elements_.push_back(elements_.size());
+    field_.AddLightRay(pray);
+    AddElement(pray);
+}
+
+void OpticsBox::ToggleTimeline()
+{
+    if (!Timeline::IsRecording())
+    {
+        Timeline::Start();
+        return;
+    }
+    Timeline::Stop();
+    std::ofstream out("timeline.json");
+    Timeline::WriteChromeTrace(out);
+    if (out)
+        fl_message("Timeline written to timeline.json");
+    else
+        fl_alert("Cannot write timeline.json!");
 }
 
 int OpticsBox::handle(int event)
@@ -132,10 +721,21 @@ int OpticsBox::handle(int event)
             axis_.Scale(0.97, Point(x() + w() / 2, y() + h() / 2));
         else
             axis_.Scale(1.03, Point(x() + w() / 2, y() + h() / 2));
-        redraw();
+        damage(kDamageElements);
+    }
+    else if (event == FL_MOVE || event == FL_LEAVE)
+    {
+        std::optional<size_t> hovered = event == FL_MOVE ? Pick(curx, cury) : std::nullopt;
+        if (hovered != hovered_)
+        {
+            hovered_ = hovered;
+            redraw();
+        }
     }
     else if (event == FL_PUSH)
     {
+        selected_ = Pick(curx, cury);
+        redraw();
     }
     else if (event == FL_RELEASE)
     {
@@ -145,18 +745,23 @@ int OpticsBox::handle(int event)
     else if (event == FL_DRAG)
     {
         if (last_x > 0 && last_y > 0)
+        {
             axis_.Move(curx - last_x, cury - last_y);
+            damage(kDamageElements);
+        }
         last_x = curx;
         last_y = cury;
-        redraw();
     }
     else if (event == FL_KEYBOARD)
     {
         if(Fl::event_key() == 'c')
         {
-            Clear();
+            TIMELINE_SCOPE("reload", "gui");
             RunLuaScript();
-            RunSimulation();
+        }
+        else if (Fl::event_key() == 't')
+        {
+            ToggleTimeline();
         }
         else
         {
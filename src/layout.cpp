@@ -0,0 +1,128 @@
+#include "layout.h"
+
+LayoutBuilder *LuaLayout::builder_ = nullptr;
+
+namespace
+{
+    // Raise a Lua error blaming argument arg unless entries [1, n] of the array at stack index array are numbers; called before
+    // ProtectedCall, which a Lua error must not leave
+    void CheckArrayNumbers(lua_State *L, int array, lua_Integer n, int arg)
+    {
+        for (lua_Integer i = 1; i <= n; i++)
+        {
+            lua_rawgeti(L, array, i);
+            int isnum = 0;
+            lua_tonumberx(L, -1, &isnum);
+            lua_pop(L, 1);
+            if (!isnum)
+                luaL_argerror(L, arg, lua_pushfstring(L, "entry %d is not a number", static_cast<int>(i)));
+        }
+    }
+
+    // Number at index i of the array at stack index array, checked by CheckArrayNumbers
+    double GetArrayNumber(lua_State *L, int array, lua_Integer i)
+    {
+        lua_rawgeti(L, array, i);
+        double value = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        return value;
+    }
+
+    LayoutBuilder &GetBuilder(lua_State *L)
+    {
+        if (LuaLayout::builder_ == nullptr)
+            luaL_error(L, "no layout to add to");
+        return *LuaLayout::builder_;
+    }
+}
+
+void LuaLayout::Register(LuaInterpreter &interpreter)
+{
+    interpreter.RegisterLuaFunction<AddMirrorFunctor>("add_mirror");
+    interpreter.RegisterLuaFunction<AddLensFunctor>("add_lens");
+    interpreter.RegisterLuaFunction<AddRefractiveFunctor>("add_refractive");
+    interpreter.RegisterLuaFunction<AddLightRayFunctor>("add_lightray");
+    interpreter.RegisterLuaCFunction("add_refractive_polyline", AddRefractivePolyline);
+    interpreter.RegisterLuaCFunction("add_lightrays", AddLightRays);
+}
+
+int LuaLayout::AddRefractivePolyline(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    double n_left = luaL_checknumber(L, 3);
+    double n_right = luaL_checknumber(L, 4);
+    lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, 1));
+    luaL_argcheck(L, static_cast<lua_Integer>(lua_rawlen(L, 2)) == n, 2, "xs and ys differ in length");
+    LayoutBuilder &builder = GetBuilder(L);
+    if (n < 2)
+        return 0;
+    CheckArrayNumbers(L, 1, n, 1);
+    CheckArrayNumbers(L, 2, n, 2);
+    return LuaInterpreter::ProtectedCall(L, [&]
+                                         {
+                                             builder.Reserve(n - 1, 0);
+                                             Point start(GetArrayNumber(L, 1, 1), GetArrayNumber(L, 2, 1));
+                                             for (lua_Integer i = 2; i <= n; i++)
+                                             {
+                                                 Point end(GetArrayNumber(L, 1, i), GetArrayNumber(L, 2, i));
+                                                 builder.AddRefractive(RefractiveSurface(Segment(start, end - start), n_left, n_right));
+                                                 start = end;
+                                             }
+                                             return 0; });
+}
+
+int LuaLayout::AddLightRays(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, 1));
+    LayoutBuilder &builder = GetBuilder(L);
+    for (lua_Integer i = 1; i <= n; i++)
+    {
+        if (lua_rawgeti(L, 1, i) != LUA_TTABLE || lua_rawlen(L, -1) != 4)
+            luaL_argerror(L, 1, lua_pushfstring(L, "entry %d is not {start_x, start_y, direction_x, direction_y}", static_cast<int>(i)));
+        CheckArrayNumbers(L, lua_gettop(L), 4, 1);
+        lua_pop(L, 1);
+    }
+    return LuaInterpreter::ProtectedCall(L, [&]
+                                         {
+                                             builder.Reserve(0, n);
+                                             for (lua_Integer i = 1; i <= n; i++)
+                                             {
+                                                 lua_rawgeti(L, 1, i);
+                                                 int ray = lua_gettop(L);
+                                                 Point start(GetArrayNumber(L, ray, 1), GetArrayNumber(L, ray, 2));
+                                                 Vec direction(GetArrayNumber(L, ray, 3), GetArrayNumber(L, ray, 4));
+                                                 lua_pop(L, 1);
+                                                 builder.AddLightRay(Ray(start, direction));
+                                             }
+                                             return 0; });
+}
+
+void LuaLayout::AddMirrorFunctor::operator()(double start_x, double start_y, double end_x, double end_y) const
+{
+    if (LuaLayout::builder_ == nullptr)
+        throw LuaExecutionException("no layout to add to");
+    LuaLayout::builder_->AddMirror(Mirror(Segment(Point(start_x, start_y), Point(end_x - start_x, end_y - start_y))));
+}
+
+void LuaLayout::AddLensFunctor::operator()(double start_x, double start_y, double end_x, double end_y, double focal_length) const
+{
+    if (LuaLayout::builder_ == nullptr)
+        throw LuaExecutionException("no layout to add to");
+    LuaLayout::builder_->AddLens(Lens(Segment(Point(start_x, start_y), Point(end_x - start_x, end_y - start_y)), focal_length));
+}
+
+void LuaLayout::AddRefractiveFunctor::operator()(double start_x, double start_y, double end_x, double end_y, double n_left, double n_right) const
+{
+    if (LuaLayout::builder_ == nullptr)
+        throw LuaExecutionException("no layout to add to");
+    LuaLayout::builder_->AddRefractive(RefractiveSurface(Segment(Point(start_x, start_y), Point(end_x - start_x, end_y - start_y)), n_left, n_right));
+}
+
+void LuaLayout::AddLightRayFunctor::operator()(double start_x, double start_y, double direction_x, double direction_y) const
+{
+    if (LuaLayout::builder_ == nullptr)
+        throw LuaExecutionException("no layout to add to");
+    LuaLayout::builder_->AddLightRay(Ray(Point(start_x, start_y), Point(direction_x, direction_y)));
+}
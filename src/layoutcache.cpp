@@ -0,0 +1,250 @@
+#include "layoutcache.h"
+#include "mappedfile.h"
+#include "timeline.h"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+namespace
+{
+    // Increase whenever the layout records or the Lua functions of layout scripts change meaning
+    constexpr uint32_t kCacheVersion = 1;
+    constexpr char kMagic[8] = {'O', 'P', 'T', 'L', 'A', 'Y', 'T', '\0'};
+
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t key;
+        uint64_t record_count;
+    };
+
+    // 64-bit FNV-1a
+    uint64_t HashBytes(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    LayoutRecord MakeRecord(uint32_t kind, const Line &line, double a = 0.0, double b = 0.0)
+    {
+        Point start = line.GetStart();
+        Vec direction = line.GetDirection();
+        return LayoutRecord{kind, 0, {start.x, start.y, direction.x, direction.y, a, b}};
+    }
+
+    // Binds a LayoutBuilder to the Lua functions of layout scripts for the lifetime of the binding
+    class BuilderBinding
+    {
+    private:
+        LayoutBuilder *previous_;
+
+    public:
+        explicit BuilderBinding(LayoutBuilder *builder) : previous_(LuaLayout::builder_) { LuaLayout::Bind(builder); }
+        ~BuilderBinding() { LuaLayout::Bind(previous_); }
+    };
+}
+
+void LayoutRecorder::AddMirror(const Mirror &mirror)
+{
+    records_.push_back(MakeRecord(LayoutRecord::MirrorRecord, mirror.seg_));
+    if (forward_ != nullptr)
+        forward_->AddMirror(mirror);
+}
+
+void LayoutRecorder::AddLens(const Lens &lens)
+{
+    records_.push_back(MakeRecord(LayoutRecord::LensRecord, lens.seg_, lens.focal_length_));
+    if (forward_ != nullptr)
+        forward_->AddLens(lens);
+}
+
+void LayoutRecorder::AddRefractive(const RefractiveSurface &refractive)
+{
+    records_.push_back(MakeRecord(LayoutRecord::RefractiveRecord, refractive.seg_, refractive.n_left_, refractive.n_right_));
+    if (forward_ != nullptr)
+        forward_->AddRefractive(refractive);
+}
+
+void LayoutRecorder::AddLightRay(const Ray &ray)
+{
+    records_.push_back(MakeRecord(LayoutRecord::LightRayRecord, ray));
+    if (forward_ != nullptr)
+        forward_->AddLightRay(ray);
+}
+
+void LayoutRecorder::Reserve(size_t deflectors, size_t light_rays)
+{
+    ReserveMore(records_, deflectors + light_rays);
+    if (forward_ != nullptr)
+        forward_->Reserve(deflectors, light_rays);
+}
+
+void ReplayLayout(const LayoutRecord *records, size_t count, LayoutBuilder &builder)
+{
+    size_t light_rays = 0;
+    for (size_t i = 0; i < count; i++)
+        light_rays += records[i].kind == LayoutRecord::LightRayRecord;
+    builder.Reserve(count - light_rays, light_rays);
+    for (size_t i = 0; i < count; i++)
+    {
+        const double *v = records[i].values;
+        Point start(v[0], v[1]);
+        Vec direction(v[2], v[3]);
+        switch (records[i].kind)
+        {
+        case LayoutRecord::MirrorRecord:
+            builder.AddMirror(Mirror{Segment(start, direction)});
+            break;
+        case LayoutRecord::LensRecord:
+            builder.AddLens(Lens{Segment(start, direction), v[4]});
+            break;
+        case LayoutRecord::RefractiveRecord:
+            builder.AddRefractive(RefractiveSurface{Segment(start, direction), v[4], v[5]});
+            break;
+        case LayoutRecord::LightRayRecord:
+            builder.AddLightRay(Ray(start, direction));
+            break;
+        }
+    }
+}
+
+std::filesystem::path LayoutCache::GetDefaultDirectory()
+{
+    if (const char *directory = std::getenv("OPTSIM_CACHE_DIR"))
+        return directory;
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+        return std::filesystem::path(xdg) / "optsim";
+    if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+        return std::filesystem::path(home) / ".cache" / "optsim";
+    return {};
+}
+
+std::optional<uint64_t> LayoutCache::HashScript(const std::string &script_file)
+{
+    MappedFile script(script_file);
+    if (!script.IsOpen())
+        return std::nullopt;
+    uint64_t hash = HashBytes(&kCacheVersion, sizeof(kCacheVersion));
+    return HashBytes(script.GetData(), script.GetSize(), hash);
+}
+
+std::filesystem::path LayoutCache::GetPath(uint64_t key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.layout", static_cast<unsigned long long>(key));
+    return directory_ / name;
+}
+
+bool LayoutCache::Load(uint64_t key, LayoutBuilder &builder) const
+{
+    if (!IsEnabled())
+        return false;
+    TIMELINE_SCOPE("load cached layout", "script");
+    MappedFile file(GetPath(key).string());
+    if (!file.IsOpen() || file.GetSize() < sizeof(CacheHeader))
+        return false;
+    CacheHeader header;
+    std::memcpy(&header, file.GetData(), sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kCacheVersion ||
+        header.record_size != sizeof(LayoutRecord) || header.key != key ||
+        header.record_count != (file.GetSize() - sizeof(CacheHeader)) / sizeof(LayoutRecord) ||
+        (file.GetSize() - sizeof(CacheHeader)) % sizeof(LayoutRecord) != 0)
+        return false;
+    // The records follow the header, aligned since the mapping is page-aligned and the header a multiple of 8 bytes
+    const LayoutRecord *records = reinterpret_cast<const LayoutRecord *>(static_cast<const char *>(file.GetData()) + sizeof(CacheHeader));
+    for (size_t i = 0; i < header.record_count; i++)
+        if (records[i].kind > LayoutRecord::LightRayRecord)
+            return false;
+    ReplayLayout(records, header.record_count, builder);
+    // Mark the layout as recently used, so that Evict keeps it
+    std::error_code error;
+    std::filesystem::last_write_time(GetPath(key), std::filesystem::file_time_type::clock::now(), error);
+    return true;
+}
+
+bool LayoutCache::Store(uint64_t key, const LayoutRecorder &recorder) const
+{
+    if (!IsEnabled())
+        return false;
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    if (error)
+        return false;
+    // Write to a temporary file renamed into place, so that a concurrent Load never sees a partial file
+    std::filesystem::path path = GetPath(key);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    const std::vector<LayoutRecord> &records = recorder.GetRecords();
+    CacheHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kCacheVersion;
+    header.record_size = sizeof(LayoutRecord);
+    header.key = key;
+    header.record_count = records.size();
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(LayoutRecord)));
+        out.close();
+        if (!out)
+        {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+        return false;
+    Evict();
+    return true;
+}
+
+void LayoutCache::Evict() const
+{
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(directory_, error), end; !error && it != end; it.increment(error))
+    {
+        if (it->path().extension() != ".layout")
+            continue;
+        std::filesystem::file_time_type time = it->last_write_time(error);
+        if (!error)
+            entries.emplace_back(time, it->path());
+        error.clear();
+    }
+    if (entries.size() <= kMaxEntries)
+        return;
+    std::sort(entries.begin(), entries.end());
+    // Failures are ignored: another process may have removed the file first
+    for (size_t i = 0; i + kMaxEntries < entries.size(); i++)
+        std::filesystem::remove(entries[i].second, error);
+}
+
+bool RunLayoutScript(LuaInterpreter &interpreter, const std::string &script_file, LayoutBuilder &builder, const LayoutCache &cache)
+{
+    std::optional<uint64_t> key = cache.IsEnabled() ? LayoutCache::HashScript(script_file) : std::nullopt;
+    if (key.has_value() && cache.Load(*key, builder))
+        return true;
+    if (!key.has_value())
+    {
+        BuilderBinding binding(&builder);
+        interpreter.Run(script_file);
+        return false;
+    }
+    LayoutRecorder recorder(&builder);
+    {
+        BuilderBinding binding(&recorder);
+        interpreter.Run(script_file);
+    }
+    cache.Store(*key, recorder);
+    return false;
+}
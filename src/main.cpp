@@ -8,6 +8,8 @@
 int main()
 {
     // Test();
+    // Enable the locking that lets the simulation thread wake the FLTK thread with Fl::awake
+    Fl::lock();
     Fl_Window window(1280, 800, "optics simulator");
     OpticsBox optics_box(10, 10, 1260, 780, "optics box");
     window.add(optics_box);
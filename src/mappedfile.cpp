@@ -0,0 +1,53 @@
+#include "mappedfile.h"
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// An empty file maps to this, as mmap rejects empty mappings
+static const char kEmpty[1] = {};
+
+MappedFile::MappedFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size == 0)
+            data_ = kEmpty;
+        else
+        {
+            void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                data_ = data;
+                size_ = static_cast<size_t>(st.st_size);
+            }
+        }
+    }
+    // The mapping keeps the file alive
+    close(fd);
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0))
+{
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    // The old mapping goes away with moved
+    MappedFile moved(std::move(other));
+    std::swap(data_, moved.data_);
+    std::swap(size_, moved.size_);
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != nullptr && data_ != kEmpty)
+        munmap(const_cast<void *>(data_), size_);
+}
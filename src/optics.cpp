@@ -1,138 +1,667 @@
 #include "optics.h"
+#include "packet.h"
+#include "timeline.h"
+#include "pathstream.h"
+#include "raysource.h"
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <bit>
+#include <cmath>
+#include <numbers>
 
-bool LightRay::Step()
+const char *GetRayStatusName(RayStatus status)
+{
+    switch (status)
+    {
+    case RayStatus::Propagating:
+        return "propagating";
+    case RayStatus::Escaped:
+        return "escaped";
+    case RayStatus::Absorbed:
+        return "absorbed";
+    case RayStatus::StepLimit:
+        return "step_limit";
+    case RayStatus::Attenuated:
+        return "attenuated";
+    case RayStatus::Trapped:
+        return "trapped";
+    case RayStatus::Degenerate:
+        return "degenerate";
+    }
+    return "unknown";
+}
+
+void SimulationStats::Reset(size_t deflector_count)
+{
+    rays = intersection_tests = hits = bounces = max_bounces = 0;
+    terminations.fill(0);
+    bounce_histogram.clear();
+    deflector_tests.assign(deflector_count, 0);
+    deflector_hits.assign(deflector_count, 0);
+}
+
+void SimulationStats::AddRay(RayStatus status, size_t ray_bounces)
+{
+    rays++;
+    bounces += ray_bounces;
+    max_bounces = std::max<uint64_t>(max_bounces, ray_bounces);
+    terminations[static_cast<size_t>(status)]++;
+    size_t k = std::bit_width(ray_bounces);
+    if (bounce_histogram.size() <= k)
+        bounce_histogram.resize(k + 1, 0);
+    bounce_histogram[k]++;
+}
+
+void SimulationStats::Merge(const SimulationStats &other)
+{
+    rays += other.rays;
+    bounces += other.bounces;
+    max_bounces = std::max(max_bounces, other.max_bounces);
+    for (size_t k = 0; k < kRayStatusCount; k++)
+        terminations[k] += other.terminations[k];
+    if (bounce_histogram.size() < other.bounce_histogram.size())
+        bounce_histogram.resize(other.bounce_histogram.size(), 0);
+    for (size_t k = 0; k < other.bounce_histogram.size(); k++)
+        bounce_histogram[k] += other.bounce_histogram[k];
+    // The totals of the tests and hits are summed from the counters of the Deflectors, which are all the hot path updates
+    for (size_t i = 0; i < deflector_tests.size() && i < other.deflector_tests.size(); i++)
+    {
+        deflector_tests[i] += other.deflector_tests[i];
+        deflector_hits[i] += other.deflector_hits[i];
+        intersection_tests += other.deflector_tests[i];
+        hits += other.deflector_hits[i];
+    }
+}
+
+IncidenceState LightRay::GetIncidence(const Scene &scene, size_t i)
+{
+    return std::visit(
+        [this](const auto &deflector) -> IncidenceState
+        {
+            if constexpr (std::is_same_v<std::decay_t<decltype(deflector)>, CustomDeflector>)
+            {
+                try
+                {
+                    return deflector.deflector_->Incidence(*this, ray_);
+                }
+                catch (...)
+                {
+                    Stop(RayStatus::Degenerate);
+                    return {{Intersection::ZeroIntersection, 0., 0.}, false, ray_.GetDirection()};
+                }
+            }
+            else
+                return ComputeIncidence(deflector, ray_);
+        },
+        scene.GetDeflector(i));
+}
+
+IncidenceState LightRay::GetIncidence(const Scene &scene, size_t i, const Intersection &intersection)
+{
+    const CompiledDeflector &deflector = scene.GetDeflector(i);
+    if (std::holds_alternative<CustomDeflector>(deflector))
+        return GetIncidence(scene, i);
+    return {intersection, std::holds_alternative<Wall>(deflector), ray_.GetDirection()};
+}
+
+bool LightRay::FindNearestLinear(const Scene &scene, size_t &nearest_i, IncidenceState &nearest_s)
 {
-    size_t nearest_i;
-    IncidenceState nearest_s;
     bool intersect = false;
-    for (size_t i = 0; i < deflectors_.size(); i++)
+    // A ray leaving the bounds of the scene skips the scan; the hierarchy makes the same test at its root
+    double t_enter, t_exit;
+    if (scene.GetBounds().Clip(ray_, t_enter, t_exit) == false)
+        return false;
+    for (size_t i = 0; i < scene.Size(); i++)
     {
-        IncidenceState s = deflectors_[i]->Incidence(*this, ray_);
-        if (i == excluded_deflector_ || s.GetNumIntersects() == Intersection::ZeroIntersection)
+        if (i == excluded_deflector_)
+            continue;
+        if (stats_ != nullptr)
+            stats_->deflector_tests[i]++;
+        IncidenceState s = GetIncidence(scene, i);
+        if (s.GetNumIntersects() == Intersection::ZeroIntersection)
         {
             // No intersection points with this Deflector, or the Deflector is excluded; skip this Deflector
             continue;
         }
-        else if (s.termination == true)
+        if (intersect == false || s.GetRayParameter() < nearest_s.GetRayParameter())
         {
-            // The Deflector terminates the propagation of the LightRay
-            path_.emplace_back(ray_.GetStart(), ray_.GetPoint(s.GetRayParameter()));
-            return false;
-        }
-        else
-        {
-            if (intersect == false || s.GetRayParameter() < nearest_s.GetRayParameter())
-            {
-                nearest_i = i;
-                nearest_s = s;
-                intersect = true;
-            }
+            nearest_i = i;
+            nearest_s = s;
+            intersect = true;
         }
     }
-    if (intersect)
+    return intersect;
+}
+
+bool LightRay::FindNearestHierarchical(const Scene &scene, size_t &nearest_i, IncidenceState &nearest_s)
+{
+    bool intersect = false;
+    scene.GetBVH()->Traverse(ray_, std::numeric_limits<double>::infinity(),
+                   [&](size_t i, double &t_max)
+                   {
+                       if (i == excluded_deflector_)
+                           return;
+                       if (stats_ != nullptr)
+                           stats_->deflector_tests[i]++;
+                       IncidenceState s = GetIncidence(scene, i);
+                       if (s.GetNumIntersects() == Intersection::ZeroIntersection)
+                           return;
+                       // Ties are broken by the lower index, as in the linear scan
+                       double t = s.GetRayParameter();
+                       if (intersect == false || t < nearest_s.GetRayParameter() || (t == nearest_s.GetRayParameter() && i < nearest_i))
+                       {
+                           nearest_i = i;
+                           nearest_s = s;
+                           intersect = true;
+                           t_max = t;
+                       }
+                   });
+    return intersect;
+}
+
+bool LightRay::Step(const Scene &scene)
+{
+    size_t nearest_i;
+    IncidenceState nearest_s;
+    bool intersect = scene.GetBVH() != nullptr ? FindNearestHierarchical(scene, nearest_i, nearest_s) : FindNearestLinear(scene, nearest_i, nearest_s);
+    if (status_ != RayStatus::Propagating)
+        return false;
+    if (intersect == false)
     {
-        excluded_deflector_ = nearest_i;
-        path_.emplace_back(ray_.GetStart(), ray_.GetPoint(nearest_s.GetRayParameter()) - ray_.GetStart());
-        ray_ = deflectors_[nearest_i]->Emergence(*this, nearest_s);
+        Stop(RayStatus::Escaped);
+        return false;
     }
-    else
+    return Deflect(scene, nearest_i, nearest_s);
+}
+
+bool LightRay::Deflect(const Scene &scene, size_t i, const IncidenceState &s)
+{
+    if (stats_ != nullptr)
+        stats_->deflector_hits[i]++;
+    if (s.termination == true)
     {
+        // The Deflector terminates the propagation of the LightRay
+        writer_->Push(ray_.GetPoint(s.GetRayParameter()));
+        Stop(RayStatus::Absorbed);
         return false;
     }
+    bool valid = true;
+    Ray ray = std::visit(
+        [&](const auto &deflector) -> Ray
+        {
+            if constexpr (std::is_same_v<std::decay_t<decltype(deflector)>, CustomDeflector>)
+            {
+                try
+                {
+                    return deflector.deflector_->Emergence(*this, s);
+                }
+                catch (...)
+                {
+                    valid = false;
+                    return ray_;
+                }
+            }
+            else
+            {
+                if constexpr (std::is_same_v<std::decay_t<decltype(deflector)>, CompiledRefractiveSurface>)
+                    energy_ *= ComputeTransmittance(deflector, s);
+                return ComputeEmergence(deflector, s);
+            }
+        },
+        scene.GetDeflector(i));
+    Vec direction = ray.GetDirection();
+    if (valid == false || direction == kZeroVec || direction.IsFinite() == false || ray.GetStart().IsFinite() == false)
+    {
+        // Keep the hit point so that the path shows where the LightRay was lost
+        writer_->Push(ray_.GetPoint(s.GetRayParameter()));
+        Stop(RayStatus::Degenerate);
+        return false;
+    }
+    excluded_deflector_ = i;
+    ray_ = ray;
+    bounces_++;
+    writer_->Push(ray_.GetStart());
     return true;
 }
 
-IncidenceState MirrorDeflector::Incidence(LightRay &light_ray, Ray ray) const
+CompiledMirror::CompiledMirror(const Mirror &mirror) : seg_(mirror.seg_)
+{
+    normal_ = seg_.GetDirection().Rotate90Anticlockwise().Normalize();
+}
+
+CompiledLens::CompiledLens(const Lens &lens) : seg_(lens.seg_), focal_length_(lens.focal_length_)
+{
+    Vec t = seg_.GetDirection();
+    length_ = t.Norm();
+    half_length_ = 0.5 * length_;
+    tangent_ = t.Scale(1.0 / length_);
+    normal_ = tangent_.Rotate90Anticlockwise();
+    inv_focal_length_ = 1.0 / focal_length_;
+}
+
+CompiledRefractiveSurface::CompiledRefractiveSurface(const RefractiveSurface &refractive)
+    : seg_(refractive.seg_), n_left_(refractive.n_left_), n_right_(refractive.n_right_)
+{
+    tangent_ = seg_.GetDirection().Normalize();
+    normal_ = tangent_.Rotate90Anticlockwise();
+    ratio_from_left_ = n_left_ / n_right_;
+    ratio_from_right_ = n_right_ / n_left_;
+}
+
+IncidenceState ComputeIncidence(const CompiledMirror &mirror, const Ray &ray) noexcept
+{
+    return {GetLineIntersection(ray, mirror.seg_), false, ray.GetDirection()};
+}
+
+Ray ComputeEmergence(const CompiledMirror &mirror, const IncidenceState &s) noexcept
 {
-    return {GetLineIntersection(ray, mirror_.seg_), false, ray.GetDirection()};
+    // Reverse the normal component of the incident direction
+    double dn = s.ray_direction.Dot(mirror.normal_);
+    return Ray(mirror.seg_.GetPoint(s.GetDeflectorParameter()), s.ray_direction - mirror.normal_.Scale(2.0 * dn), kUncheckedDirection);
 }
 
-Ray MirrorDeflector::Emergence(LightRay &light_ray, IncidenceState s) const
+IncidenceState ComputeIncidence(const CompiledLens &lens, const Ray &ray) noexcept
 {
-    Vec t = mirror_.seg_.GetDirection();
-    Vec n = t.Rotate90Anticlockwise();
-    Vec x = s.ray_direction.Projection(n);
-    Vec y = s.ray_direction.Projection(t);
-    return Ray(mirror_.seg_.GetPoint(s.GetDeflectorParameter()), y - x);
+    return {GetLineIntersection(ray, lens.seg_), false, ray.GetDirection()};
 }
 
-IncidenceState LensDeflector::Incidence(LightRay &light_ray, Ray ray) const
+Ray ComputeEmergence(const CompiledLens &lens, const IncidenceState &s) noexcept
 {
-    return {GetLineIntersection(ray, lens_.seg_), false, ray.GetDirection()};
+    // Height of the hit above the optical center, and the tangential deviation it causes; the deviation points away from
+    // the center for a negative focal length, whichever side the ray comes from
+    double dn = s.ray_direction.Dot(lens.normal_);
+    double h = s.GetDeflectorParameter() * lens.length_ - lens.half_length_;
+    Vec c = lens.tangent_.Scale(std::abs(dn) * h * lens.inv_focal_length_);
+    return Ray(lens.seg_.GetPoint(s.GetDeflectorParameter()), s.ray_direction - c, kUncheckedDirection);
 }
 
-Ray LensDeflector::Emergence(LightRay &light_ray, IncidenceState s) const
+IncidenceState ComputeIncidence(const CompiledRefractiveSurface &refractive, const Ray &ray) noexcept
+{
+    return {GetLineIntersection(ray, refractive.seg_), false, ray.GetDirection()};
+}
+
+Ray ComputeEmergence(const CompiledRefractiveSurface &refractive, const IncidenceState &s) noexcept
+{
+    double dn = s.ray_direction.Dot(refractive.normal_);
+    double dt = s.ray_direction.Dot(refractive.tangent_);
+    bool from_left = dn < 0.0;
+    // The tangential component is scaled by the index ratio, the normal component keeps its sign and takes up the rest of the norm
+    Vec x = refractive.normal_.Scale(dn);
+    Vec y_n = refractive.tangent_.Scale(dt * (from_left ? refractive.ratio_from_left_ : refractive.ratio_from_right_));
+    Point p = refractive.seg_.GetPoint(s.GetDeflectorParameter());
+    double c = s.ray_direction.NormSquare() - y_n.NormSquare();
+    if (c < 0)
+        // Total internal reflection
+        return Ray(p, s.ray_direction - x.Scale(2.0), kUncheckedDirection);
+    Vec x_n = refractive.normal_.Scale(from_left ? -std::sqrt(c) : std::sqrt(c));
+    return Ray(p, x_n + y_n, kUncheckedDirection);
+}
+
+double ComputeTransmittance(const CompiledRefractiveSurface &refractive, const IncidenceState &s) noexcept
+{
+    double dn = s.ray_direction.Dot(refractive.normal_);
+    double dt = s.ray_direction.Dot(refractive.tangent_);
+    bool from_left = dn < 0.0;
+    double n1 = from_left ? refractive.n_left_ : refractive.n_right_;
+    double n2 = from_left ? refractive.n_right_ : refractive.n_left_;
+    // Cosines of the angles of incidence and refraction, relative to the norm of the direction, which refraction preserves
+    double d2 = s.ray_direction.NormSquare();
+    double yt = dt * (from_left ? refractive.ratio_from_left_ : refractive.ratio_from_right_);
+    double c = d2 - yt * yt;
+    if (c < 0)
+        return 1.0;
+    double cos_i = std::abs(dn) / std::sqrt(d2);
+    double cos_t = std::sqrt(c / d2);
+    double rs = (n1 * cos_i - n2 * cos_t) / (n1 * cos_i + n2 * cos_t);
+    double rp = (n2 * cos_i - n1 * cos_t) / (n2 * cos_i + n1 * cos_t);
+    double t = 1.0 - 0.5 * (rs * rs + rp * rp);
+    // Grazing incidence makes both ratios 0/0
+    return std::isfinite(t) ? std::clamp(t, 0.0, 1.0) : 0.0;
+}
+
+IncidenceState ComputeIncidence(const Wall &wall, const Ray &ray) noexcept
+{
+    return {GetLineIntersection(ray, wall.seg_), true, ray.GetDirection()};
+}
+
+Ray ComputeEmergence(const Wall &wall, const IncidenceState &s) noexcept
+{
+    return Ray(wall.seg_.GetPoint(s.GetDeflectorParameter()), s.ray_direction, kUncheckedDirection);
+}
+
+IncidenceState MirrorDeflector::Incidence(LightRay &, Ray ray) const { return ComputeIncidence(CompiledMirror(mirror_), ray); }
+
+Ray MirrorDeflector::Emergence(LightRay &, IncidenceState s) const { return ComputeEmergence(CompiledMirror(mirror_), s); }
+
+IncidenceState LensDeflector::Incidence(LightRay &, Ray ray) const { return ComputeIncidence(CompiledLens(lens_), ray); }
+
+Ray LensDeflector::Emergence(LightRay &, IncidenceState s) const
 {
-    Vec t = lens_.seg_.GetDirection();
-    Vec n = t.Rotate90Anticlockwise();
-    Vec x = s.ray_direction.Projection(n);
-    Vec y = s.ray_direction.Projection(t);
-    double h = (s.GetDeflectorParameter() - 0.5) * t.Norm();
     if (lens_.focal_length_ == 0.0)
         throw ZeroDivisionException();
-    Vec c;
-    if (x.Dot(n) < 0.0)
-        // from left
-        c = x.Rotate90Anticlockwise().Scale(h / lens_.focal_length_);
-    else
-        // from right
-        c = x.Rotate90Clockwise().Scale(h / lens_.focal_length_);
-    return Ray(lens_.seg_.GetPoint(s.GetDeflectorParameter()), s.ray_direction - c);
+    return ComputeEmergence(CompiledLens(lens_), s);
 }
 
-IncidenceState RefractiveDeflector::Incidence(LightRay &light_ray, Ray ray) const
+IncidenceState RefractiveDeflector::Incidence(LightRay &, Ray ray) const { return ComputeIncidence(CompiledRefractiveSurface(refractive_), ray); }
+
+Ray RefractiveDeflector::Emergence(LightRay &, IncidenceState s) const
+{
+    if (refractive_.n_left_ == 0.0 || refractive_.n_right_ == 0.0)
+        throw ZeroDivisionException();
+    return ComputeEmergence(CompiledRefractiveSurface(refractive_), s);
+}
+
+IncidenceState WallDeflector::Incidence(LightRay &, Ray ray) const { return ComputeIncidence(wall_, ray); }
+
+Ray WallDeflector::Emergence(LightRay &, IncidenceState s) const { return ComputeEmergence(wall_, s); }
+
+Scene::Scene(const std::vector<std::shared_ptr<Deflector>> &deflectors, IntersectionMode mode)
+    : sources_(deflectors), hierarchical_(mode == IntersectionMode::BoundingVolumeHierarchy)
 {
-    return {GetLineIntersection(ray, refractive_.seg_), false, ray.GetDirection()};
+    compiled_.reserve(deflectors.size());
+    segments_.reserve(deflectors.size());
+    for (size_t i = 0; i < deflectors.size(); i++)
+    {
+        Segment seg = deflectors[i]->GetSegment();
+        Vec d = seg.GetDirection();
+        if (seg.GetStart().IsFinite() == false || d.IsFinite() == false)
+            throw InvalidDeflectorException(i, "segment with a non-finite coordinate");
+        // The square of the length must not underflow either, as it is divided by when normalizing
+        if (d.NormSquare() == 0.0 || std::isfinite(d.NormSquare()) == false)
+            throw InvalidDeflectorException(i, "segment of zero or overflowing length");
+        const char *reason = std::visit(
+            [](const auto &deflector) -> const char *
+            {
+                using T = std::decay_t<decltype(deflector)>;
+                if constexpr (std::is_same_v<T, CompiledLens>)
+                {
+                    if (deflector.focal_length_ == 0.0 || std::isfinite(deflector.focal_length_) == false)
+                        return "lens with a zero or non-finite focal length";
+                }
+                else if constexpr (std::is_same_v<T, CompiledRefractiveSurface>)
+                {
+                    if (deflector.n_left_ == 0.0 || deflector.n_right_ == 0.0 ||
+                        std::isfinite(deflector.n_left_) == false || std::isfinite(deflector.n_right_) == false)
+                        return "refractive surface with a zero or non-finite index";
+                }
+                return nullptr;
+            },
+            compiled_.emplace_back(deflectors[i]->Compile()));
+        if (reason != nullptr)
+            throw InvalidDeflectorException(i, reason);
+        segments_.push_back(seg);
+        bounds_.Expand(GetPaddedBoundingBox(seg));
+    }
+    if (hierarchical_)
+        bvh_.Build(segments_);
 }
 
-Ray RefractiveDeflector::Emergence(LightRay &light_ray, IncidenceState s) const
+bool Field::WithinLimits(LightRay &light_ray, CycleDetector &cycle, size_t steps) const
 {
-    Vec t = refractive_.seg_.GetDirection();
-    Vec n = t.Rotate90Anticlockwise();
-    Vec x = s.ray_direction.Projection(n);
-    Vec y = s.ray_direction.Projection(t);
-    Vec y_n;
-    if (x.Dot(n) < 0.0)
+    if (steps >= options_.max_bounces)
+    {
+        light_ray.Stop(RayStatus::StepLimit);
+        return false;
+    }
+    if (light_ray.GetEnergy() < options_.min_energy)
     {
-        // from left
-        if (refractive_.n_right_ == 0.0)
-            throw ZeroDivisionException();
-        y_n = y.Scale(refractive_.n_left_ / refractive_.n_right_);
+        light_ray.Stop(RayStatus::Attenuated);
+        return false;
     }
-    else
+    if (options_.detect_cycles && cycle.Visit(light_ray))
     {
-        // from right
-        if (refractive_.n_left_ == 0.0)
-            throw ZeroDivisionException();
-        y_n = y.Scale(refractive_.n_right_ / refractive_.n_left_);
+        light_ray.Stop(RayStatus::Trapped);
+        return false;
     }
-    double c = s.ray_direction.NormSquare() - y_n.NormSquare();
-    if (c < 0)
-        return Ray(refractive_.seg_.GetPoint(s.GetDeflectorParameter()), y - x);
-    Vec x_n = x.Normalize().Scale(std::sqrt(c));
-    return Ray(refractive_.seg_.GetPoint(s.GetDeflectorParameter()), x_n + y_n);
-}   
+    return true;
+}
 
-IncidenceState WallDeflector::Incidence(LightRay &light_ray, Ray ray) const
+LightRay &Field::GetLightRay(size_t i, std::optional<LightRay> &scratch) const
 {
-    return {GetLineIntersection(ray, wall_.seg_), true, ray.GetDirection()};
+    if (i < light_rays_.size())
+        return *light_rays_[i];
+    size_t k = i - light_rays_.size();
+    return scratch.emplace(ray_source_->GetRay(k), ray_source_->GetWeight(k));
 }
 
-Ray WallDeflector::Emergence(LightRay &light_ray, IncidenceState s) const
+void Field::Finish(LightRay &light_ray, size_t i, PathArena::Writer &writer, size_t thread_id) const
 {
-    return Ray(wall_.seg_.GetPoint(s.GetDeflectorParameter()), s.ray_direction);
+    light_ray.Finish();
+    if (path_stream_ != nullptr)
+        path_stream_->Write(thread_id, i, light_ray);
+    // Nothing reads the path of a ray of ray_source_ after this
+    if (path_stream_ != nullptr || i >= light_rays_.size())
+    {
+        writer.Discard();
+        light_ray.DiscardPath();
+    }
+    else if (control_ != nullptr && control_->on_finish)
+        control_->on_finish(i);
+}
+
+void Field::Trace(size_t i, const Scene &scene, PathArena::Writer &writer, SimulationStats *stats, size_t thread_id) const
+{
+    std::optional<LightRay> scratch;
+    LightRay &light_ray = GetLightRay(i, scratch);
+    light_ray.Reset(writer, stats);
+    CycleDetector cycle;
+    cycle.Reset(light_ray);
+    for (size_t step = 1; light_ray.GetStatus() == RayStatus::Propagating; step++)
+    {
+        bool is_continue = light_ray.Step(scene);
+        if (is_continue == false || WithinLimits(light_ray, cycle, step) == false)
+            break;
+    }
+    Finish(light_ray, i, writer, thread_id);
 }
 
-void Field::Simulation()
+void Field::TracePackets(size_t begin, size_t end, const Scene &scene, PathArena::Writer *writers, SimulationStats *stats, size_t thread_id) const
 {
-    for (auto light_ray : light_rays_)
+    RayPacket packet;
+    PacketHits hits;
+    LightRay *lanes[kPacketWidth];
+    std::optional<LightRay> scratch[kPacketWidth];
+    size_t indices[kPacketWidth];
+    size_t steps[kPacketWidth];
+    CycleDetector cycles[kPacketWidth];
+    // The lanes are filled in order of the direction of the initial rays, then of their starts along a Z-order curve over the
+    // bounds of the scene, so that the rays of a packet traverse the same nodes of the hierarchy for as long as they stay close
+    constexpr uint64_t kDirectionBuckets = 64;
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(end - begin);
+    const BoundingBox &bounds = scene.GetBounds();
+    // An axis of the bounds that is empty, as with no Deflectors, or not finite puts every start at 0 along it
+    Vec extent = bounds.max - bounds.min;
+    double inverse_x = extent.x > 0.0 && std::isfinite(extent.x) ? 1.0 / extent.x : 0.0;
+    double inverse_y = extent.y > 0.0 && std::isfinite(extent.y) ? 1.0 / extent.y : 0.0;
+    // Level of u in [0, 1] among levels, with 0 for u not a number, such as from a zero or NaN direction of a RaySource
+    auto quantize = [](double u, uint64_t levels)
     {
-        light_ray->Reset(deflectors_);
-        for (size_t step = 0; step < 1000; step++)
+        if (!(u > 0.0))
+            return uint64_t(0);
+        return u >= 1.0 ? levels - 1 : static_cast<uint64_t>(u * static_cast<double>(levels - 1));
+    };
+    auto spread = [](uint64_t v)
+    {
+        v = (v | (v << 8)) & 0x00ff00ffu;
+        v = (v | (v << 4)) & 0x0f0f0f0fu;
+        v = (v | (v << 2)) & 0x33333333u;
+        return (v | (v << 1)) & 0x55555555u;
+    };
+    for (size_t n = begin; n < end; n++)
+    {
+        size_t i = GetTraceIndex(n);
+        Ray ray = i < light_rays_.size() ? light_rays_[i]->GetInitialRay() : ray_source_->GetRay(i - light_rays_.size());
+        Vec d = ray.GetDirection();
+        uint64_t bucket = quantize((std::atan2(d.y, d.x) + std::numbers::pi) / (2.0 * std::numbers::pi), kDirectionBuckets);
+        Point s = ray.GetStart();
+        uint64_t morton = spread(quantize((s.x - bounds.min.x) * inverse_x, 65536)) | (spread(quantize((s.y - bounds.min.y) * inverse_y, 65536)) << 1);
+        order.push_back({(bucket << 32) | morton, i});
+    }
+    std::sort(order.begin(), order.end());
+    size_t next = 0;
+    auto refill = [&](size_t lane)
+    {
+        if (lanes[lane] != nullptr)
+            Finish(*lanes[lane], indices[lane], writers[lane], thread_id);
+        lanes[lane] = nullptr;
+        while (next < order.size() && !IsCancelled())
         {
-            bool is_continue = light_ray->Step();
+            indices[lane] = order[next++].second;
+            LightRay &light_ray = GetLightRay(indices[lane], scratch[lane]);
+            light_ray.Reset(writers[lane], stats);
+            // A LightRay that stops right away, such as a degenerate ray of the RaySource, never takes the lane
+            if (light_ray.GetStatus() != RayStatus::Propagating)
+            {
+                Finish(light_ray, indices[lane], writers[lane], thread_id);
+                continue;
+            }
+            lanes[lane] = &light_ray;
+            cycles[lane].Reset(light_ray);
+            steps[lane] = 0;
+            break;
+        }
+    };
+    for (size_t lane = 0; lane < kPacketWidth; lane++)
+    {
+        lanes[lane] = nullptr;
+        refill(lane);
+    }
+
+    while (true)
+    {
+        bool any = false;
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+        {
+            // A lane whose ray leaves the bounds of the scene takes the next LightRay before the packet is intersected
+            double t_enter, t_exit;
+            while (lanes[lane] != nullptr && scene.GetBounds().Clip(lanes[lane]->GetRay(), t_enter, t_exit) == false)
+            {
+                lanes[lane]->Stop(RayStatus::Escaped);
+                refill(lane);
+            }
+            if (lanes[lane] == nullptr)
+            {
+                packet.Disable(lane);
+                continue;
+            }
+            packet.Set(lane, lanes[lane]->GetRay(), static_cast<int64_t>(lanes[lane]->GetExcludedDeflector()));
+            any = true;
+        }
+        if (any == false)
+            break;
+        IntersectPacket(packet, scene.GetSegments(), scene.GetBVH(), hits, stats != nullptr ? stats->deflector_tests.data() : nullptr);
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+        {
+            LightRay *light_ray = lanes[lane];
+            if (light_ray == nullptr)
+                continue;
+            bool is_continue = false;
+            if (hits.Hit(lane))
+            {
+                size_t i = static_cast<size_t>(hits.segment[lane]);
+                Intersection intersection{Intersection::OneIntersection, hits.ray_parameter[lane], hits.segment_parameter[lane]};
+                IncidenceState s = light_ray->GetIncidence(scene, i, intersection);
+                if (s.GetNumIntersects() == Intersection::OneIntersection)
+                    is_continue = light_ray->Deflect(scene, i, s);
+            }
             if (is_continue == false)
-                break;
+                light_ray->Stop(RayStatus::Escaped);
+            if (is_continue == false || WithinLimits(*light_ray, cycles[lane], ++steps[lane]) == false)
+                refill(lane);
         }
     }
 }
+
+bool Field::ShouldRetraceAll(const std::vector<size_t> &order) const
+{
+    size_t live = 0;
+    for (const auto &light_ray : light_rays_)
+        live += light_ray->GetPath().Size();
+    for (size_t i : order)
+        if (i < light_rays_.size())
+            live -= light_rays_[i]->GetPath().Size();
+    return arena_vertices_ > 2 * live;
+}
+
+void Field::Simulation(SimulationControl *control)
+{
+    TIMELINE_SCOPE("simulation", "simulation");
+    // Cleared on every exit, including by the exception of an invalid Deflector
+    struct ControlScope
+    {
+        Field *field;
+        ~ControlScope() { field->control_ = nullptr; }
+    } control_scope{this};
+    control_ = control;
+    if (scene_ == nullptr)
+    {
+        TIMELINE_SCOPE("compile scene", "simulation");
+        scene_ = std::make_shared<const Scene>(deflectors_, intersection_mode_);
+    }
+    // Hold the snapshot for the whole run; every LightRay traces against it by reference
+    std::shared_ptr<const Scene> scene = scene_;
+    bool keep_others = control != nullptr && control->keep_others;
+    if (!keep_others)
+        arena_.Reset();
+    if (thread_count_ != 1 && pool_ == nullptr)
+        pool_ = std::make_unique<ThreadPool>(thread_count_);
+    size_t thread_count = pool_ != nullptr ? pool_->GetThreadCount() : 1;
+    // One Writer per thread, or per lane of each thread's RayPacket
+    size_t writers_per_thread = packet_tracing_ ? kPacketWidth : 1;
+    std::vector<PathArena::Writer> writers(thread_count * writers_per_thread, PathArena::Writer(arena_));
+    // Counters of each thread, merged once every LightRay is traced
+    std::vector<SimulationStats> thread_stats(collect_stats_ ? thread_count : 0);
+    for (auto &stats : thread_stats)
+        stats.Reset(scene->Size());
+    if (path_stream_ != nullptr)
+        path_stream_->BeginSimulation(thread_count);
+    size_t light_ray_count = keep_others ? control->order.size() : light_rays_.size() + (ray_source_ != nullptr ? ray_source_->Size() : 0);
+    auto trace = [&](size_t begin, size_t end, size_t thread_id)
+    {
+        TIMELINE_SCOPE("trace chunk", "simulation");
+        PathArena::Writer *thread_writers = &writers[thread_id * writers_per_thread];
+        SimulationStats *stats = collect_stats_ ? &thread_stats[thread_id] : nullptr;
+        if (packet_tracing_)
+            TracePackets(begin, end, *scene, thread_writers, stats, thread_id);
+        else
+            for (size_t i = begin; i < end && !IsCancelled(); i++)
+                Trace(GetTraceIndex(i), *scene, *thread_writers, stats, thread_id);
+    };
+    auto trace_all = [&](size_t begin, size_t end)
+    {
+        if (thread_count_ == 1)
+        {
+            trace(begin, end, 0);
+            return;
+        }
+        // Small chunks let idle threads steal the rays left behind by long bounce chains
+        size_t chunk_size = std::max<size_t>(1, (end - begin) / (thread_count * 16));
+        if (packet_tracing_)
+            chunk_size = (chunk_size + kPacketWidth - 1) / kPacketWidth * kPacketWidth;
+        pool_->ParallelFor(end - begin, chunk_size,
+                           [&](size_t chunk_begin, size_t chunk_end, size_t thread_id)
+                           { trace(begin + chunk_begin, begin + chunk_end, thread_id); });
+    };
+    size_t priority_count = control != nullptr ? std::min(control->priority_count, light_ray_count) : 0;
+    if (priority_count > 0)
+        trace_all(0, priority_count);
+    trace_all(priority_count, light_ray_count);
+    if (path_stream_ != nullptr)
+        path_stream_->EndSimulation();
+
+    // The paths just written; those they replace in a partial run stay in arena_ until its next reset
+    if (!keep_others)
+        arena_vertices_ = 0;
+    for (size_t n = 0; n < light_ray_count; n++)
+        if (size_t i = GetTraceIndex(n); i < light_rays_.size())
+            arena_vertices_ += light_rays_[i]->GetPath().Size();
+
+    if (collect_stats_)
+    {
+        stats_.Reset(scene->Size());
+        for (const auto &stats : thread_stats)
+            stats_.Merge(stats);
+    }
+}
@@ -0,0 +1,179 @@
+#include "packet.h"
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// The kernels evaluate the same products and sums as GetLineIntersection, in the same order, so the results agree bit for bit
+
+#if defined(__AVX512F__)
+
+void IntersectPacket(const RayPacket &packet, const Segment &seg, int64_t i, PacketHits &hits)
+{
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d one = _mm512_set1_pd(1.0);
+    __m512d s1x = _mm512_load_pd(packet.start_x), s1y = _mm512_load_pd(packet.start_y);
+    __m512d d1x = _mm512_load_pd(packet.direction_x), d1y = _mm512_load_pd(packet.direction_y);
+    __m512d s2x = _mm512_set1_pd(seg.GetStart().x), s2y = _mm512_set1_pd(seg.GetStart().y);
+    __m512d d2x = _mm512_set1_pd(seg.GetDirection().x), d2y = _mm512_set1_pd(seg.GetDirection().y);
+
+    __m512d den1 = _mm512_sub_pd(_mm512_mul_pd(d1x, d2y), _mm512_mul_pd(d1y, d2x));
+    __m512d den2 = _mm512_sub_pd(_mm512_mul_pd(d2x, d1y), _mm512_mul_pd(d2y, d1x));
+    __m512d dsx = _mm512_sub_pd(s2x, s1x), dsy = _mm512_sub_pd(s2y, s1y);
+    __m512d t1 = _mm512_div_pd(_mm512_sub_pd(_mm512_mul_pd(dsx, d2y), _mm512_mul_pd(dsy, d2x)), den1);
+    __m512d num2 = _mm512_sub_pd(_mm512_mul_pd(dsx, d1y), _mm512_mul_pd(dsy, d1x));
+    __m512d t2 = _mm512_div_pd(_mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(num2), _mm512_set1_epi64(INT64_MIN))), den2);
+
+    __mmask8 valid = _mm512_cmp_pd_mask(den1, zero, _CMP_NEQ_UQ) & _mm512_cmp_pd_mask(den2, zero, _CMP_NEQ_UQ) &
+                     _mm512_cmp_pd_mask(t1, zero, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t2, zero, _CMP_GE_OQ) &
+                     _mm512_cmp_pd_mask(t2, one, _CMP_LE_OQ);
+    __m512i index = _mm512_set1_epi64(i);
+    valid &= ~_mm512_cmpeq_epi64_mask(_mm512_load_si512(packet.excluded), index);
+
+    __m512d best_t = _mm512_load_pd(hits.ray_parameter);
+    __m512i best_i = _mm512_load_si512(hits.segment);
+    __mmask8 nearer = _mm512_cmp_pd_mask(t1, best_t, _CMP_LT_OQ) |
+                      (_mm512_cmp_pd_mask(t1, best_t, _CMP_EQ_OQ) & _mm512_cmpgt_epi64_mask(best_i, index));
+    __mmask8 update = valid & nearer;
+    _mm512_store_pd(hits.ray_parameter, _mm512_mask_blend_pd(update, best_t, t1));
+    _mm512_store_pd(hits.segment_parameter, _mm512_mask_blend_pd(update, _mm512_load_pd(hits.segment_parameter), t2));
+    _mm512_store_si512(hits.segment, _mm512_mask_blend_epi64(update, best_i, index));
+}
+
+#elif defined(__AVX2__)
+
+void IntersectPacket(const RayPacket &packet, const Segment &seg, int64_t i, PacketHits &hits)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d s1x = _mm256_load_pd(packet.start_x), s1y = _mm256_load_pd(packet.start_y);
+    __m256d d1x = _mm256_load_pd(packet.direction_x), d1y = _mm256_load_pd(packet.direction_y);
+    __m256d s2x = _mm256_set1_pd(seg.GetStart().x), s2y = _mm256_set1_pd(seg.GetStart().y);
+    __m256d d2x = _mm256_set1_pd(seg.GetDirection().x), d2y = _mm256_set1_pd(seg.GetDirection().y);
+
+    __m256d den1 = _mm256_sub_pd(_mm256_mul_pd(d1x, d2y), _mm256_mul_pd(d1y, d2x));
+    __m256d den2 = _mm256_sub_pd(_mm256_mul_pd(d2x, d1y), _mm256_mul_pd(d2y, d1x));
+    __m256d dsx = _mm256_sub_pd(s2x, s1x), dsy = _mm256_sub_pd(s2y, s1y);
+    __m256d t1 = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(dsx, d2y), _mm256_mul_pd(dsy, d2x)), den1);
+    __m256d num2 = _mm256_sub_pd(_mm256_mul_pd(dsx, d1y), _mm256_mul_pd(dsy, d1x));
+    __m256d t2 = _mm256_div_pd(_mm256_xor_pd(num2, _mm256_set1_pd(-0.0)), den2);
+
+    __m256d valid = _mm256_and_pd(_mm256_cmp_pd(den1, zero, _CMP_NEQ_UQ), _mm256_cmp_pd(den2, zero, _CMP_NEQ_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(t1, zero, _CMP_GE_OQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(t2, zero, _CMP_GE_OQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(t2, one, _CMP_LE_OQ));
+    __m256i index = _mm256_set1_epi64x(i);
+    __m256i excluded = _mm256_cmpeq_epi64(_mm256_load_si256(reinterpret_cast<const __m256i *>(packet.excluded)), index);
+    valid = _mm256_andnot_pd(_mm256_castsi256_pd(excluded), valid);
+
+    __m256d best_t = _mm256_load_pd(hits.ray_parameter);
+    __m256i best_i = _mm256_load_si256(reinterpret_cast<const __m256i *>(hits.segment));
+    __m256d tie = _mm256_and_pd(_mm256_cmp_pd(t1, best_t, _CMP_EQ_OQ), _mm256_castsi256_pd(_mm256_cmpgt_epi64(best_i, index)));
+    __m256d nearer = _mm256_or_pd(_mm256_cmp_pd(t1, best_t, _CMP_LT_OQ), tie);
+    __m256d update = _mm256_and_pd(valid, nearer);
+    _mm256_store_pd(hits.ray_parameter, _mm256_blendv_pd(best_t, t1, update));
+    _mm256_store_pd(hits.segment_parameter, _mm256_blendv_pd(_mm256_load_pd(hits.segment_parameter), t2, update));
+    __m256d blended_i = _mm256_blendv_pd(_mm256_castsi256_pd(best_i), _mm256_castsi256_pd(index), update);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(hits.segment), _mm256_castpd_si256(blended_i));
+}
+
+#else
+
+void IntersectPacket(const RayPacket &packet, const Segment &seg, int64_t i, PacketHits &hits)
+{
+    Point s2 = seg.GetStart();
+    Vec d2 = seg.GetDirection();
+    for (size_t lane = 0; lane < kPacketWidth; lane++)
+    {
+        Vec d1{packet.direction_x[lane], packet.direction_y[lane]};
+        Vec ds21 = s2 - Point{packet.start_x[lane], packet.start_y[lane]};
+        double den1 = d1.Dot(d2.Rotate90Clockwise());
+        double den2 = d2.Dot(d1.Rotate90Clockwise());
+        if (den1 == 0 || den2 == 0 || packet.excluded[lane] == i)
+            continue;
+        double t1 = ds21.Dot(d2.Rotate90Clockwise()) / den1;
+        double t2 = -ds21.Dot(d1.Rotate90Clockwise()) / den2;
+        if (!(t1 >= 0) || !(t2 >= 0 && t2 <= 1))
+            continue;
+        if (t1 < hits.ray_parameter[lane] || (t1 == hits.ray_parameter[lane] && i < hits.segment[lane]))
+        {
+            hits.ray_parameter[lane] = t1;
+            hits.segment_parameter[lane] = t2;
+            hits.segment[lane] = i;
+        }
+    }
+}
+
+#endif
+
+void IntersectPacket(const RayPacket &packet, const std::vector<Segment> &segments, const SegmentBVH *bvh, PacketHits &hits, uint64_t *tests)
+{
+    hits.Reset();
+    uint64_t lanes = 0;
+    if (tests != nullptr)
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+            lanes += packet.active[lane] ? 1 : 0;
+    if (bvh == nullptr)
+    {
+        for (size_t i = 0; i < segments.size(); i++)
+            IntersectPacket(packet, segments[i], static_cast<int64_t>(i), hits);
+        if (tests != nullptr)
+            for (size_t i = 0; i < segments.size(); i++)
+                tests[i] += lanes;
+        return;
+    }
+    // Reciprocals of the directions, so that testing a box takes multiplications only; the boxes of the hierarchy are padded by
+    // far more than the rounding this adds to the entry parameters
+    double inverse_x[kPacketWidth], inverse_y[kPacketWidth];
+    for (size_t lane = 0; lane < kPacketWidth; lane++)
+    {
+        inverse_x[lane] = 1.0 / packet.direction_x[lane];
+        inverse_y[lane] = 1.0 / packet.direction_y[lane];
+    }
+    // The slab [lo, hi] narrows [t_enter, t_exit]; a product that is not a number, for a ray along the boundary of the slab,
+    // leaves it as it is, as BoundingBox::Clip does for a start within the slab
+    auto clip_axis = [](double s, double inverse, double lo, double hi, double &t_enter, double &t_exit)
+    {
+        double t1 = (lo - s) * inverse, t2 = (hi - s) * inverse;
+        if (t1 > t2)
+            std::swap(t1, t2);
+        if (t1 == t1)
+            t_enter = std::max(t_enter, t1);
+        if (t2 == t2)
+            t_exit = std::min(t_exit, t2);
+    };
+    // A node is entered if any lane reaches it before its own nearest hit; the packet stops at the farthest of those hits
+    auto test = [&](const BoundingBox &box, double &t_enter)
+    {
+        bool hit = false;
+        t_enter = std::numeric_limits<double>::infinity();
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+        {
+            if (!packet.active[lane])
+                continue;
+            double t_lane = 0.0, t_exit = hits.ray_parameter[lane];
+            clip_axis(packet.start_x[lane], inverse_x[lane], box.min.x, box.max.x, t_lane, t_exit);
+            clip_axis(packet.start_y[lane], inverse_y[lane], box.min.y, box.max.y, t_lane, t_exit);
+            if (t_lane <= t_exit)
+            {
+                t_enter = std::min(t_enter, t_lane);
+                hit = true;
+            }
+        }
+        return hit;
+    };
+    auto visit = [&](const uint32_t *indices, uint32_t count, double &t_max)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            IntersectPacket(packet, segments[indices[k]], static_cast<int64_t>(indices[k]), hits);
+        if (tests != nullptr)
+            for (uint32_t k = 0; k < count; k++)
+                tests[indices[k]] += lanes;
+        t_max = 0.0;
+        for (size_t lane = 0; lane < kPacketWidth; lane++)
+            if (packet.active[lane])
+                t_max = std::max(t_max, hits.ray_parameter[lane]);
+    };
+    bvh->TraverseLeaves(std::numeric_limits<double>::infinity(), test, visit);
+}
@@ -0,0 +1,146 @@
+#include "pathstream.h"
+#include <charconv>
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    constexpr char kMagic[8] = {'O', 'P', 'T', 'P', 'A', 'T', 'H', '\0'};
+    constexpr uint32_t kVersion = 1;
+
+    struct PathRecordHeader
+    {
+        uint64_t index;
+        uint32_t status;
+        uint32_t count;
+        double energy;
+    };
+
+    template <class T>
+    void AppendBytes(std::string &data, const T &value)
+    {
+        data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    // Append value followed by separator, in the shortest form that reads back exactly
+    template <class T>
+    void AppendNumber(std::string &data, T value, char separator)
+    {
+        char buffer[32];
+        char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+        *end++ = separator;
+        data.append(buffer, end);
+    }
+}
+
+PathStream::PathStream(std::ostream &out, PathFormat format, size_t max_chunks)
+    : out_(&out), format_(format), max_chunks_(std::max<size_t>(1, max_chunks))
+{
+    if (format_ == PathFormat::Binary)
+    {
+        out_->write(kMagic, sizeof(kMagic));
+        uint32_t version_and_flags[2] = {kVersion, 0};
+        out_->write(reinterpret_cast<const char *>(version_and_flags), sizeof(version_and_flags));
+    }
+    thread_ = std::thread([this] { Run(); });
+}
+
+PathStream::~PathStream() { Close(); }
+
+void PathStream::BeginSimulation(size_t thread_count)
+{
+    chunks_.resize(thread_count);
+    for (ThreadChunk &chunk : chunks_)
+        chunk.data.reserve(kChunkSize);
+}
+
+void PathStream::Write(size_t thread_id, uint64_t light_ray_index, const LightRay &light_ray)
+{
+    ThreadChunk &chunk = chunks_[thread_id];
+    const PathView &path = light_ray.GetPath();
+    if (format_ == PathFormat::Binary)
+    {
+        AppendBytes(chunk.data, PathRecordHeader{light_ray_index, static_cast<uint32_t>(light_ray.GetStatus()), static_cast<uint32_t>(path.Size()), light_ray.GetEnergy()});
+        chunk.data.append(reinterpret_cast<const char *>(path.begin()), path.Size() * sizeof(Point));
+    }
+    else
+    {
+        AppendNumber(chunk.data, light_ray_index, ' ');
+        chunk.data += GetRayStatusName(light_ray.GetStatus());
+        chunk.data += ' ';
+        AppendNumber(chunk.data, light_ray.GetEnergy(), ' ');
+        AppendNumber(chunk.data, path.Size(), path.Size() > 0 ? ' ' : '\n');
+        for (size_t k = 0; k < path.Size(); k++)
+        {
+            AppendNumber(chunk.data, path[k].x, ' ');
+            AppendNumber(chunk.data, path[k].y, k + 1 < path.Size() ? ' ' : '\n');
+        }
+    }
+    chunk.paths++;
+    if (chunk.data.size() >= kChunkSize)
+        Submit(chunk);
+}
+
+void PathStream::EndSimulation()
+{
+    for (ThreadChunk &chunk : chunks_)
+        if (!chunk.data.empty())
+            Submit(chunk);
+}
+
+void PathStream::Submit(ThreadChunk &chunk)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < max_chunks_; });
+    queue_.push_back(std::move(chunk.data));
+    paths_ += chunk.paths;
+    chunk.paths = 0;
+    if (!spare_.empty())
+    {
+        chunk.data = std::move(spare_.back());
+        spare_.pop_back();
+    }
+    else
+        chunk.data = std::string();
+    chunk.data.clear();
+    chunk.data.reserve(kChunkSize);
+    not_empty_.notify_one();
+}
+
+void PathStream::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        not_empty_.wait(lock, [this] { return !queue_.empty() || closing_; });
+        if (queue_.empty())
+            return;
+        std::string data = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_all();
+        lock.unlock();
+        out_->write(data.data(), static_cast<std::streamsize>(data.size()));
+        lock.lock();
+        spare_.push_back(std::move(data));
+    }
+}
+
+bool PathStream::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closing_)
+            return !out_->fail();
+        closing_ = true;
+        not_empty_.notify_one();
+    }
+    thread_.join();
+    out_->flush();
+    return !out_->fail();
+}
+
+uint64_t PathStream::GetPathCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return paths_;
+}
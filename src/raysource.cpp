@@ -0,0 +1,38 @@
+#include "raysource.h"
+#include <cstring>
+
+namespace
+{
+    constexpr char kMagic[8] = {'O', 'P', 'T', 'R', 'A', 'Y', 'S', '\0'};
+    constexpr uint32_t kVersion = 1;
+
+    struct RayFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t count;
+    };
+}
+
+RaySource::RaySource(const std::string &path) : file_(path)
+{
+    if (!file_.IsOpen())
+        throw RayFileException("cannot open ray file " + path);
+    RayFileHeader header;
+    if (file_.GetSize() < sizeof(header))
+        throw RayFileException(path + " is not a ray file");
+    std::memcpy(&header, file_.GetData(), sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+        throw RayFileException(path + " is not a ray file");
+    if (header.version != kVersion || (header.flags & ~(kHasWavelength | kHasWeight)) != 0)
+        throw RayFileException(path + " has an unsupported version or flags");
+    flags_ = header.flags;
+    stride_ = 4 + ((flags_ & kHasWavelength) != 0) + ((flags_ & kHasWeight) != 0);
+    size_t record_bytes = stride_ * sizeof(double);
+    if (header.count > (file_.GetSize() - sizeof(header)) / record_bytes || file_.GetSize() - sizeof(header) != header.count * record_bytes)
+        throw RayFileException(path + " is truncated or has trailing bytes");
+    count_ = static_cast<size_t>(header.count);
+    // The mapping is page-aligned and the header a multiple of 8 bytes, so the records are aligned
+    records_ = reinterpret_cast<const double *>(static_cast<const char *>(file_.GetData()) + sizeof(header));
+}
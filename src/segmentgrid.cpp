@@ -0,0 +1,89 @@
+#include "segmentgrid.h"
+#include <cmath>
+
+template <class Visitor>
+void SegmentGrid::ForEachCell(const Entry &entry, Visitor &&visit) const
+{
+    Point a = entry.start, b = entry.end;
+    if (a.x > b.x)
+        std::swap(a, b);
+    size_t c0 = GetColumn(a.x), c1 = GetColumn(b.x);
+    double slope = b.x > a.x ? (b.y - a.y) / (b.x - a.x) : 0.0;
+    for (size_t c = c0; c <= c1; c++)
+    {
+        // The part of the segment within the column
+        double x_low = c == c0 ? a.x : origin_.x + c / inverse_cell_width_;
+        double x_high = c == c1 ? b.x : origin_.x + (c + 1) / inverse_cell_width_;
+        double y_low = c == c0 ? a.y : a.y + (x_low - a.x) * slope;
+        double y_high = c == c1 ? b.y : a.y + (x_high - a.x) * slope;
+        size_t r0 = GetRow(std::min(y_low, y_high)), r1 = GetRow(std::max(y_low, y_high));
+        for (size_t r = r0; r <= r1; r++)
+            visit(r * columns_ + c);
+    }
+}
+
+void SegmentGrid::Build(std::vector<Entry> entries)
+{
+    Clear();
+    BoundingBox bounds;
+    for (const Entry &entry : entries)
+        if (entry.start.IsFinite() && entry.end.IsFinite())
+        {
+            entries_.push_back(entry);
+            bounds.Expand(entry.start);
+            bounds.Expand(entry.end);
+        }
+    if (entries_.empty())
+        return;
+    bounds_ = bounds;
+
+    // Square cells, about as many as there are entries, or a single row or column of them when the entries are collinear
+    Vec extent = bounds.Extent();
+    double target = static_cast<double>(std::min(entries_.size(), kMaxCells));
+    double area = extent.x * extent.y;
+    double cell = area > 0.0 ? std::sqrt(area / target) : std::max(extent.x, extent.y) / target;
+    auto count = [&](double length)
+    {
+        if (!(cell > 0.0) || !(length > 0.0))
+            return size_t(1);
+        return static_cast<size_t>(std::clamp(std::ceil(length / cell), 1.0, static_cast<double>(kMaxAxisCells)));
+    };
+    columns_ = count(extent.x);
+    rows_ = count(extent.y);
+    origin_ = bounds.min;
+    inverse_cell_width_ = extent.x > 0.0 ? columns_ / extent.x : 0.0;
+    inverse_cell_height_ = extent.y > 0.0 ? rows_ / extent.y : 0.0;
+
+    // Count the entries of each cell, turn the counts into offsets, then fill the cells
+    cell_start_.assign(columns_ * rows_ + 1, 0);
+    for (const Entry &entry : entries_)
+        ForEachCell(entry, [&](size_t cell) { cell_start_[cell + 1]++; });
+    for (size_t i = 1; i < cell_start_.size(); i++)
+        cell_start_[i] += cell_start_[i - 1];
+    cell_entries_.resize(cell_start_.back());
+    std::vector<uint32_t> fill(cell_start_.begin(), cell_start_.end() - 1);
+    for (size_t i = 0; i < entries_.size(); i++)
+        ForEachCell(entries_[i], [&](size_t cell) { cell_entries_[fill[cell]++] = static_cast<uint32_t>(i); });
+}
+
+std::optional<SegmentGrid::Entry> SegmentGrid::FindNearest(const Point &p, double max_distance) const
+{
+    BoundingBox box;
+    box.Expand(p);
+    box.Pad(max_distance);
+    std::optional<Entry> nearest;
+    double nearest_square = max_distance * max_distance;
+    ForEachInBox(box, [&](const Entry &entry)
+    {
+        Vec d = entry.end - entry.start;
+        double length_square = d.NormSquare();
+        double t = length_square > 0.0 ? std::clamp((p - entry.start).Dot(d) / length_square, 0.0, 1.0) : 0.0;
+        double distance_square = (entry.start + d.Scale(t) - p).NormSquare();
+        if (distance_square <= nearest_square)
+        {
+            nearest_square = distance_square;
+            nearest = entry;
+        }
+    });
+    return nearest;
+}
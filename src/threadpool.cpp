@@ -0,0 +1,131 @@
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t num_threads)
+{
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < num_threads; i++)
+        queues_.push_back(std::make_unique<Queue>());
+    for (size_t i = 1; i < num_threads; i++)
+        threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_)
+        thread.join();
+}
+
+void ThreadPool::ParallelFor(size_t n, size_t chunk_size, const Task &task)
+{
+    if (n == 0)
+        return;
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+
+    // Give each thread a contiguous run of chunks; imbalance is left to stealing
+    size_t num_queues = queues_.size();
+    for (size_t q = 0; q < num_queues; q++)
+    {
+        size_t first = num_chunks * q / num_queues, last = num_chunks * (q + 1) / num_queues;
+        std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+        for (size_t c = first; c < last; c++)
+            queues_[q]->chunks.push_back({c * chunk_size, std::min(n, (c + 1) * chunk_size)});
+    }
+
+    failed_ = false;
+    error_ = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        busy_ = threads_.size();
+        generation_++;
+    }
+    wake_.notify_all();
+    RunChunks(0);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]
+                   { return busy_ == 0; });
+        task_ = nullptr;
+    }
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+void ThreadPool::WorkerLoop(size_t thread_id)
+{
+    uint64_t seen_generation = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]
+                       { return stop_ || generation_ != seen_generation; });
+            if (stop_)
+                return;
+            seen_generation = generation_;
+        }
+        RunChunks(thread_id);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            busy_--;
+        }
+        done_.notify_one();
+    }
+}
+
+void ThreadPool::RunChunks(size_t thread_id)
+{
+    Chunk chunk;
+    while (PopChunk(thread_id, chunk))
+    {
+        if (failed_)
+            continue;
+        try
+        {
+            (*task_)(chunk.begin, chunk.end, thread_id);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!failed_)
+                error_ = std::current_exception();
+            failed_ = true;
+        }
+    }
+}
+
+bool ThreadPool::PopChunk(size_t thread_id, Chunk &chunk)
+{
+    // The owner takes chunks from the front of its run to keep neighboring rays together
+    {
+        Queue &own = *queues_[thread_id];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.chunks.empty())
+        {
+            chunk = own.chunks.front();
+            own.chunks.pop_front();
+            return true;
+        }
+    }
+    // Thieves take from the back, farthest from where the owner is working
+    for (size_t k = 1; k < queues_.size(); k++)
+    {
+        Queue &victim = *queues_[(thread_id + k) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.chunks.empty())
+        {
+            chunk = victim.chunks.back();
+            victim.chunks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
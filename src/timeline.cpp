@@ -0,0 +1,134 @@
+#include "timeline.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+    // Slot of the ring buffer, written under a sequence lock: sequence is k + 1 once event k is complete in the slot, and 0
+    // while a Record writes it, so that an export skips the slots claimed but not yet written, or being overwritten
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        std::atomic<const char *> name;
+        std::atomic<const char *> category;
+        std::atomic<uint64_t> begin_ns;
+        std::atomic<uint64_t> end_ns;
+        std::atomic<uint32_t> thread_id;
+    };
+
+    struct Event
+    {
+        const char *name;
+        const char *category;
+        uint64_t begin_ns;
+        uint64_t end_ns;
+        uint32_t thread_id;
+    };
+
+    std::mutex control_mutex;                // Serializes Start, Stop and WriteChromeTrace
+    std::unique_ptr<Slot[]> slots;           // Allocated by the first Start
+    std::atomic<uint64_t> next_event{0};     // Number of events ever recorded; event k is at slots[k % kCapacity]
+    uint64_t first_event = 0;                // Value of next_event at the last Start
+    uint64_t start_ns = 0;
+    std::atomic<uint32_t> next_thread_id{0};
+
+    // Read event k into event, returning false if its slot does not hold it complete
+    bool ReadEvent(uint64_t k, Event &event)
+    {
+        Slot &slot = slots[k % Timeline::kCapacity];
+        if (slot.sequence.load(std::memory_order_acquire) != k + 1)
+            return false;
+        event = Event{slot.name.load(std::memory_order_relaxed), slot.category.load(std::memory_order_relaxed),
+                      slot.begin_ns.load(std::memory_order_relaxed), slot.end_ns.load(std::memory_order_relaxed),
+                      slot.thread_id.load(std::memory_order_relaxed)};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == k + 1;
+    }
+
+    // Small id of the calling thread, assigned on its first event
+    uint32_t GetThreadId()
+    {
+        thread_local uint32_t thread_id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+        return thread_id;
+    }
+
+    // Write s as a JSON string; names and categories are literals, so only quotes and backslashes need escaping
+    void WriteString(std::ostream &out, const char *s)
+    {
+        out << '"';
+        for (; *s != '\0'; s++)
+        {
+            if (*s == '"' || *s == '\\')
+                out << '\\';
+            out << *s;
+        }
+        out << '"';
+    }
+}
+
+std::atomic<bool> Timeline::recording_{false};
+
+void Timeline::Start()
+{
+    std::lock_guard<std::mutex> lock(control_mutex);
+    recording_.store(false, std::memory_order_release);
+    if (slots == nullptr)
+        slots = std::make_unique<Slot[]>(kCapacity);
+    // The events are numbered on across Starts, so that a slot written before this Start never passes for a newer event
+    first_event = next_event.load(std::memory_order_relaxed);
+    start_ns = Now();
+    recording_.store(true, std::memory_order_release);
+}
+
+void Timeline::Stop()
+{
+    std::lock_guard<std::mutex> lock(control_mutex);
+    recording_.store(false, std::memory_order_release);
+}
+
+uint64_t Timeline::Now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void Timeline::Record(const char *name, const char *category, uint64_t begin_ns, uint64_t end_ns)
+{
+    // A scope entered before Stop may end after it, or after the next Start; slots is never freed, so the slot stays valid
+    uint64_t k = next_event.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = slots[k % kCapacity];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.category.store(category, std::memory_order_relaxed);
+    slot.begin_ns.store(begin_ns, std::memory_order_relaxed);
+    slot.end_ns.store(end_ns, std::memory_order_relaxed);
+    slot.thread_id.store(GetThreadId(), std::memory_order_relaxed);
+    slot.sequence.store(k + 1, std::memory_order_release);
+}
+
+void Timeline::WriteChromeTrace(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(control_mutex);
+    uint64_t count = next_event.load(std::memory_order_acquire);
+    uint64_t first = count - first_event > kCapacity ? count - kCapacity : first_event;
+    bool any = false;
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (uint64_t k = first; k < count && slots != nullptr; k++)
+    {
+        // Skip the events still being written, and those of scopes entered before Start
+        Event event;
+        if (!ReadEvent(k, event) || event.begin_ns < start_ns)
+            continue;
+        // Complete events, with timestamps and durations in microseconds since Start
+        double ts = static_cast<double>(static_cast<int64_t>(event.begin_ns - start_ns)) * 1e-3;
+        double dur = static_cast<double>(event.end_ns - event.begin_ns) * 1e-3;
+        out << (any ? ",\n" : "\n") << "{\"name\": ";
+        any = true;
+        WriteString(out, event.name);
+        out << ", \"cat\": ";
+        WriteString(out, event.category);
+        out << ", \"ph\": \"X\", \"ts\": " << ts << ", \"dur\": " << dur << ", \"pid\": 1, \"tid\": " << event.thread_id << "}";
+    }
+    out << "\n]}\n";
+}
@@ -13,13 +13,11 @@ for i = startY, endY, step do
   local currentY = i
   local currentX = calculateX(currentY)
   
-  table.insert(x, currentX)
+  table.insert(x, -currentX)
   table.insert(y, currentY)
 end
 
-for i = 1, #x-1 do
-  add_refractive(-x[i], y[i], -x[i+1], y[i+1], 1.5, 1.0)
-end
+add_refractive_polyline(x, y, 1.5, 1.0)
 
 add_refractive(-2.0, 3.0, -2.0, -3.0, 1.5, 1.0)
 